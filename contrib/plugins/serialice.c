@@ -0,0 +1,124 @@
+/*
+ * SerialICE - summarise the transactions SerialICE forwards to the target
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <glib.h>
+
+#include <qemu-plugin.h>
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+static const char *kind_names[] = {
+    [QEMU_PLUGIN_SERIALICE_IO_READ] = "io-read",
+    [QEMU_PLUGIN_SERIALICE_IO_WRITE] = "io-write",
+    [QEMU_PLUGIN_SERIALICE_MEM_READ] = "mem-read",
+    [QEMU_PLUGIN_SERIALICE_MEM_WRITE] = "mem-write",
+    [QEMU_PLUGIN_SERIALICE_MSR_READ] = "rdmsr",
+    [QEMU_PLUGIN_SERIALICE_MSR_WRITE] = "wrmsr",
+    [QEMU_PLUGIN_SERIALICE_CPUID] = "cpuid",
+};
+
+typedef struct {
+    enum qemu_plugin_serialice_kind kind;
+    uint64_t addr;
+    uint64_t count;
+    int64_t wire_ns;
+} Location;
+
+static GMutex lock;
+static GHashTable *locations;
+static int limit = 20;
+static bool target_only = true;
+
+static gint cmp_wire_ns(gconstpointer a, gconstpointer b)
+{
+    const Location *ea = a;
+    const Location *eb = b;
+
+    return ea->wire_ns > eb->wire_ns ? -1 : ea->wire_ns < eb->wire_ns;
+}
+
+static void plugin_exit(qemu_plugin_id_t id, void *p)
+{
+    g_autoptr(GString) report = g_string_new("kind, address, count, wire ms\n");
+    GList *it, *entries;
+    int i;
+
+    g_mutex_lock(&lock);
+    entries = g_list_sort(g_hash_table_get_values(locations), cmp_wire_ns);
+    for (it = entries, i = 0; it && i < limit; it = it->next, i++) {
+        Location *loc = it->data;
+
+        g_string_append_printf(report, "%s, 0x%08" PRIx64 ", %" PRIu64
+                               ", %" PRId64 "\n", kind_names[loc->kind],
+                               loc->addr, loc->count, loc->wire_ns / 1000000);
+    }
+    g_list_free(entries);
+    g_mutex_unlock(&lock);
+
+    qemu_plugin_outs(report->str);
+}
+
+static void vcpu_serialice(qemu_plugin_id_t id, unsigned int vcpu_index,
+                           const struct qemu_plugin_serialice_transaction *tx)
+{
+    uint64_t key = ((uint64_t)tx->kind << 56) | tx->addr;
+    Location *loc;
+
+    if (target_only && !(tx->route & QEMU_PLUGIN_SERIALICE_ROUTE_TARGET)) {
+        return;
+    }
+
+    g_mutex_lock(&lock);
+    loc = g_hash_table_lookup(locations, &key);
+    if (!loc) {
+        loc = g_new0(Location, 1);
+        loc->kind = tx->kind;
+        loc->addr = tx->addr;
+        g_hash_table_insert(locations, g_memdup2(&key, sizeof(key)), loc);
+    }
+    loc->count++;
+    loc->wire_ns += tx->wire_ns;
+    g_mutex_unlock(&lock);
+}
+
+QEMU_PLUGIN_EXPORT
+int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
+                        int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        char *opt = argv[i];
+        g_auto(GStrv) tokens = g_strsplit(opt, "=", 2);
+
+        if (g_strcmp0(tokens[0], "limit") == 0) {
+            limit = g_ascii_strtoull(tokens[1], NULL, 10);
+        } else if (g_strcmp0(tokens[0], "all") == 0) {
+            bool all;
+
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &all)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
+                return -1;
+            }
+            target_only = !all;
+        } else {
+            fprintf(stderr, "option parsing failed: %s\n", opt);
+            return -1;
+        }
+    }
+
+    locations = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                      g_free, g_free);
+
+    qemu_plugin_register_serialice_cb(id, vcpu_serialice);
+    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+    return 0;
+}
@@ -29,6 +29,7 @@
 #include "monitor/monitor.h"
 #include "trace.h"
 #include "internals.h"
+#include "serialice.h"
 
 /* System emulation specific state */
 typedef struct {
@@ -446,8 +447,8 @@ void gdb_qemu_exit(int code)
  */
 static int phy_memory_mode;
 
-int gdb_target_memory_rw_debug(CPUState *cpu, hwaddr addr,
-                               uint8_t *buf, int len, bool is_write)
+static int gdb_local_memory_rw_debug(CPUState *cpu, hwaddr addr,
+                                     uint8_t *buf, int len, bool is_write)
 {
     CPUClass *cc;
 
@@ -468,6 +469,20 @@ int gdb_target_memory_rw_debug(CPUState *cpu, hwaddr addr,
     return cpu_memory_rw_debug(cpu, addr, buf, len, is_write);
 }
 
+int gdb_target_memory_rw_debug(CPUState *cpu, hwaddr addr,
+                               uint8_t *buf, int len, bool is_write)
+{
+    int ret = gdb_local_memory_rw_debug(cpu, addr, buf, len, is_write);
+
+#ifdef CONFIG_SERIALICE
+    /* With SerialICE, parts of memory live on the target */
+    if (ret == 0) {
+        serialice_gdb_access(cpu, addr, buf, len, is_write, phy_memory_mode);
+    }
+#endif
+    return ret;
+}
+
 /*
  * cpu helpers
  */
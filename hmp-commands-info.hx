@@ -992,3 +992,66 @@ SRST
   ``info cryptodev``
     Show the crypto devices.
 ERST
+
+#ifdef CONFIG_SERIALICE
+    {
+        .name       = "serialice",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show SerialICE statistics",
+        .cmd        = hmp_info_serialice,
+    },
+#endif
+
+SRST
+  ``info serialice``
+    Show SerialICE statistics.
+ERST
+
+#ifdef CONFIG_SERIALICE
+    {
+        .name       = "serialice-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show SerialICE Lua hook profile",
+        .cmd        = hmp_info_serialice_profile,
+    },
+#endif
+
+SRST
+  ``info serialice-profile``
+    Show call counts and times per SerialICE Lua hook and the most
+    sampled script lines.
+ERST
+
+#ifdef CONFIG_SERIALICE
+    {
+        .name       = "serialice-functions",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show SerialICE time per firmware function",
+        .cmd        = hmp_info_serialice_functions,
+    },
+#endif
+
+SRST
+  ``info serialice-functions``
+    Show the firmware functions that spent the most time waiting for
+    the SerialICE target or in Lua filters.
+ERST
+
+#ifdef CONFIG_SERIALICE
+    {
+        .name       = "serialice-heatmap",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the busiest SerialICE target ports and pages",
+        .cmd        = hmp_info_serialice_heatmap,
+    },
+#endif
+
+SRST
+  ``info serialice-heatmap``
+    Show the ports and 4K pages of the SerialICE target with the most
+    wire time, and the time range they were accessed in.
+ERST
@@ -312,6 +312,63 @@ SRST
   go to lua shell.
 ERST
 
+#ifdef CONFIG_SERIALICE
+    {
+        .name       = "serialice_profile",
+        .args_type  = "op:s,count:i?",
+        .params     = "on|off|reset [count]",
+        .help       = "profile SerialICE Lua hooks, sampling script lines "
+                      "every 'count' instructions (0: no sampling)",
+        .cmd        = hmp_serialice_profile,
+    },
+#endif
+SRST
+``serialice_profile on|off|reset`` [*count*]
+  Start, stop or reset profiling of SerialICE Lua hooks.  While on, call
+  counts and times are kept per hook and the executing script line is
+  sampled every *count* Lua instructions (default 1000, 0 disables
+  sampling).  Results are shown by ``info serialice-profile``.
+ERST
+
+#ifdef CONFIG_SERIALICE
+    {
+        .name       = "serialice_function_profile",
+        .args_type  = "op:s,file:F?",
+        .params     = "on|off|reset|save [file]",
+        .help       = "account SerialICE time to firmware functions, or "
+                      "save it as folded stacks to 'file'",
+        .cmd        = hmp_serialice_function_profile,
+    },
+#endif
+SRST
+``serialice_function_profile on|off|reset|save`` [*file*]
+  Start, stop or reset accounting of SerialICE wire and Lua time to the
+  firmware function that caused each transaction, as found in the
+  symbols loaded with ``SerialICE_load_symbols``.  ``save`` writes the
+  profile to *file* in the folded stack format of ``flamegraph.pl``,
+  in microseconds.  A summary is shown by ``info serialice-functions``.
+ERST
+
+#ifdef CONFIG_SERIALICE
+    {
+        .name       = "serialice_heatmap",
+        .args_type  = "op:s,file:F?",
+        .params     = "on|off|reset|save [file]",
+        .help       = "count SerialICE target accesses per port and page "
+                      "over time, or save the counts to 'file'",
+        .cmd        = hmp_serialice_heatmap,
+    },
+#endif
+SRST
+``serialice_heatmap on|off|reset|save`` [*file*]
+  Start, stop or reset counting of SerialICE target accesses per I/O
+  port and 4K memory page, in time buckets of one second or the width
+  set by ``SerialICE_heatmap``.  ``save`` writes one line per port or
+  page and bucket to *file*, as comma separated time, kind, address,
+  reads, writes and wire time.  The busiest ports and pages are shown by
+  ``info serialice-heatmap``.
+ERST
+
 #if defined(CONFIG_TRACE_SIMPLE)
     {
         .name       = "trace-file",
@@ -50,11 +50,14 @@ typedef uint64_t qemu_plugin_id_t;
  *
  * The plugins export the API they were built against by exposing the
  * symbol qemu_plugin_version which can be checked.
+ *
+ * version 2:
+ * - added qemu_plugin_register_serialice_cb
  */
 
 extern QEMU_PLUGIN_EXPORT int qemu_plugin_version;
 
-#define QEMU_PLUGIN_VERSION 1
+#define QEMU_PLUGIN_VERSION 2
 
 /**
  * struct qemu_info_t - system information for plugins
@@ -588,6 +591,68 @@ void
 qemu_plugin_register_vcpu_syscall_ret_cb(qemu_plugin_id_t id,
                                          qemu_plugin_vcpu_syscall_ret_cb_t cb);
 
+/**
+ * enum qemu_plugin_serialice_kind - kind of a SerialICE transaction
+ *
+ * @QEMU_PLUGIN_SERIALICE_IO_READ: I/O port read
+ * @QEMU_PLUGIN_SERIALICE_IO_WRITE: I/O port write
+ * @QEMU_PLUGIN_SERIALICE_MEM_READ: memory load
+ * @QEMU_PLUGIN_SERIALICE_MEM_WRITE: memory store
+ * @QEMU_PLUGIN_SERIALICE_MSR_READ: RDMSR
+ * @QEMU_PLUGIN_SERIALICE_MSR_WRITE: WRMSR
+ * @QEMU_PLUGIN_SERIALICE_CPUID: CPUID, the value is EAX of the result
+ */
+enum qemu_plugin_serialice_kind {
+    QEMU_PLUGIN_SERIALICE_IO_READ,
+    QEMU_PLUGIN_SERIALICE_IO_WRITE,
+    QEMU_PLUGIN_SERIALICE_MEM_READ,
+    QEMU_PLUGIN_SERIALICE_MEM_WRITE,
+    QEMU_PLUGIN_SERIALICE_MSR_READ,
+    QEMU_PLUGIN_SERIALICE_MSR_WRITE,
+    QEMU_PLUGIN_SERIALICE_CPUID,
+};
+
+/* Route flags of a SerialICE transaction */
+#define QEMU_PLUGIN_SERIALICE_ROUTE_QEMU   (1 << 0)
+#define QEMU_PLUGIN_SERIALICE_ROUTE_TARGET (1 << 1)
+
+/**
+ * struct qemu_plugin_serialice_transaction - a SerialICE transaction
+ *
+ * @kind: kind of the transaction
+ * @addr: I/O port, physical address, MSR index or CPUID leaf
+ * @size: access size in bytes
+ * @value: the value written, or the value the guest read
+ * @route: QEMU_PLUGIN_SERIALICE_ROUTE_* flags; 0 for accesses that were
+ *         neither emulated nor forwarded
+ * @wire_ns: time spent waiting for the target, in nanoseconds
+ */
+struct qemu_plugin_serialice_transaction {
+    enum qemu_plugin_serialice_kind kind;
+    uint64_t addr;
+    unsigned int size;
+    uint64_t value;
+    unsigned int route;
+    int64_t wire_ns;
+};
+
+typedef void
+(*qemu_plugin_serialice_cb_t)(qemu_plugin_id_t id, unsigned int vcpu_index,
+                              const struct qemu_plugin_serialice_transaction *tx);
+
+/**
+ * qemu_plugin_register_serialice_cb() - register a SerialICE callback
+ * @id: plugin ID
+ * @cb: callback function
+ *
+ * The @cb function is called for every access SerialICE handles, after
+ * the Lua filter has seen it. @tx is only valid during the callback.
+ * Without SerialICE the callback is never called.
+ */
+QEMU_PLUGIN_API
+void qemu_plugin_register_serialice_cb(qemu_plugin_id_t id,
+                                       qemu_plugin_serialice_cb_t cb);
+
 
 /**
  * qemu_plugin_insn_disas() - return disassembly string for instruction
@@ -36,12 +36,28 @@
 #define WRITE_TO_QEMU		(1 << 0)
 #define WRITE_TO_SERIALICE	(1 << 1)
 
+/* Routes decided without asking the Lua filter, as READ_ and WRITE_ bits */
+#define ROUTE_FILTER		0
+#define ROUTE_QEMU		(1 << 0)
+#define ROUTE_TARGET		(1 << 1)
+#define ROUTE_BOTH		(ROUTE_QEMU | ROUTE_TARGET)
+
 extern const char *serialice_device;
 extern int serialice_active;
 
 uint64_t serialice_io_read(uint16_t port, unsigned int size);
 void serialice_io_write(uint16_t port, unsigned int size, uint64_t data);
 
+/* 2 bit ROUTE_* per port, checked before entering the Lua filter */
+extern uint8_t serialice_io_routes[];
+
+static inline int serialice_io_route(uint16_t port)
+{
+    return (serialice_io_routes[port >> 2] >> ((port & 3) * 2)) & 3;
+}
+
+void serialice_set_io_route(uint16_t first, uint16_t last, int route);
+
 uint64_t serialice_rdmsr(CPUArchState *env, uint32_t addr, uint32_t key);
 void serialice_wrmsr(CPUArchState *env, uint64_t data, uint32_t addr, uint32_t key);
 
@@ -55,6 +71,76 @@ int serialice_handle_load(uint32_t addr, uint64_t * result,
                           unsigned int data_size);
 int serialice_handle_store(uint32_t addr, uint64_t val, unsigned int data_size);
 
+int serialice_add_wc_range(uint32_t base, uint32_t size);
+int serialice_add_ra_range(uint32_t base, uint32_t size);
+int serialice_add_debug_range(uint32_t base, uint32_t size);
+
+#define SERIALICE_CONST_IO	0
+#define SERIALICE_CONST_MEM	1
+
+extern int serialice_const_learning;
+
+extern int serialice_pci_cache;
+int serialice_add_ecam_range(uint32_t base, uint32_t size);
+int serialice_add_const_range(int kind, uint32_t base, uint32_t size,
+                              int learn);
+void serialice_gdb_access(CPUState *cpu, uint64_t addr, uint8_t *buf,
+                          int len, bool is_write, bool phys);
+void serialice_flush(void);
+
+int serialice_register_ram(uint64_t base, uint64_t size, const char *memdev,
+                           uint64_t offset, Error **errp);
+
+/* Target macros: short programs of dependent target accesses, uploaded
+ * to the target shell once and run there with a single command.
+ */
+#define SERIALICE_MACROS		16
+#define SERIALICE_MACRO_INSNS		32
+#define SERIALICE_MACRO_REGS		8
+#define SERIALICE_MACRO_ARGS		4	/* r0-r3: arguments and results */
+#define SERIALICE_MACRO_MAX_STEPS	4096
+#define SERIALICE_MACRO_NOREG		0xff
+
+enum {
+    SERIALICE_MACRO_END,        /* stop running */
+    SERIALICE_MACRO_LI,         /* rd = operand */
+    SERIALICE_MACRO_IN,         /* rd = in(operand) */
+    SERIALICE_MACRO_OUT,        /* out(operand, rd) */
+    SERIALICE_MACRO_LOAD,       /* rd = *operand */
+    SERIALICE_MACRO_STORE,      /* *operand = rd */
+    SERIALICE_MACRO_AND,        /* rd &= operand */
+    SERIALICE_MACRO_OR,         /* rd |= operand */
+    SERIALICE_MACRO_XOR,        /* rd ^= operand */
+    SERIALICE_MACRO_ADD,        /* rd += operand */
+    SERIALICE_MACRO_SHL,        /* rd <<= operand */
+    SERIALICE_MACRO_SHR,        /* rd >>= operand */
+    SERIALICE_MACRO_BEQ,        /* if (rd == imm) goto rs */
+    SERIALICE_MACRO_BNE,        /* if (rd != imm) goto rs */
+    SERIALICE_MACRO_LOOP,       /* if (--rd) goto rs */
+};
+
+/* How a macro run ended */
+#define SERIALICE_MACRO_DONE		0
+#define SERIALICE_MACRO_STEP_LIMIT	1
+#define SERIALICE_MACRO_UNKNOWN		2	/* not defined on the target */
+
+/* The operand is imm plus register rs, unless rs is SERIALICE_MACRO_NOREG.
+ * Branches use rs as the number of the instruction to continue at.
+ */
+typedef struct {
+    uint8_t op;
+    uint8_t size;       /* access size in bytes */
+    uint8_t rd;
+    uint8_t rs;
+    uint32_t imm;
+} SerialICE_macro_insn;
+
+int serialice_define_macro(const SerialICE_macro_insn *code, int len);
+int serialice_run_macro(int id, uint32_t *regs);
+
+extern int serialice_record_writes;
+void serialice_milestone(const char *name);
+
 /* serialice protocol */
 typedef struct {
     void (*version) (void);
@@ -63,13 +149,42 @@ typedef struct {
     void (*io_write) (uint16_t port, unsigned int size, uint64_t data);
     uint64_t (*load) (uint32_t addr, unsigned int size);
     void (*store) (uint32_t addr, unsigned int size, uint64_t data);
+    void (*store_block) (uint32_t addr, const uint8_t * buf, unsigned int len);
+    void (*load_block) (uint32_t addr, uint8_t * buf, unsigned int len);
+    uint64_t (*pci_read) (uint32_t addr, unsigned int size);
+    void (*pci_write) (uint32_t addr, unsigned int size, uint64_t data);
     void (*rdmsr) (uint32_t addr, uint32_t key, uint32_t * hi, uint32_t * lo);
     void (*wrmsr) (uint32_t addr, uint32_t key, uint32_t hi, uint32_t lo);
     void (*cpuid) (uint32_t eax, uint32_t ecx, cpuid_regs_t * ret);
+    void (*macro_define) (int id, const SerialICE_macro_insn * code, int len);
+    int (*macro_run) (int id, uint32_t * regs);
 } SerialICE_target;
 
+extern const char *serialice_version;
+extern const char *serialice_mainboard;
+extern int serialice_block_transfers;
+extern int serialice_compressed_transfers;
+extern int serialice_pci_commands;
+extern int serialice_target_macros;
+extern int serialice_framed_transfers;
+extern int serialice_virtual_time;
+
 const SerialICE_target *serialice_serial_init(void);
 void serialice_serial_exit(void);
+void serialice_serial_script_reset(void);
+
+/* further targets, each driven by the one thread that bound it */
+typedef struct SerialICEState SerialICEState;
+
+const SerialICE_target *serialice_serial_open(const char *device,
+                                              SerialICEState **state);
+void serialice_serial_bind(SerialICEState *state);
+
+/* serialice lockstep run against a second target */
+#define SERIALICE_LOCKSTEP_USE_FIRST	0
+#define SERIALICE_LOCKSTEP_USE_SECOND	1
+
+int serialice_set_lockstep(const char *device, int use, int stop);
 
 /* serialice LUA */
 typedef struct {
@@ -92,8 +207,62 @@ typedef struct {
     void (*cpuid_post) (cpuid_regs_t * res);
 } SerialICE_filter;
 
-const SerialICE_filter *serialice_lua_init(const char *serialice_lua_script);
+const SerialICE_filter *serialice_lua_init(const char *serialice_lua_script,
+                                           const char *mainboard);
 void serialice_lua_exit(void);
 const char *serialice_lua_execute(const char *cmd);
 
+/* serialice function profile */
+extern int serialice_function_profile;
+
+int serialice_load_symbols(const char *path, const char *stage,
+                           int64_t offset);
+void serialice_profile_script_reset(void);
+void serialice_profile_transaction(uint64_t pc, int64_t wire_ns,
+                                   int64_t total_ns);
+
+/* serialice heatmap */
+extern int serialice_heatmap;
+
+void serialice_set_heatmap(int enable, int64_t bucket_ms);
+
+/* serialice statistics */
+typedef struct {
+    uint64_t commands;
+    int64_t wire_ns;
+    uint64_t lua_errors;
+    uint64_t wc_stores;
+    uint64_t wc_flushes;
+    uint64_t ra_hits;
+    uint64_t ra_fetches;
+    uint64_t debug_commands;
+    int64_t debug_wire_ns;
+    uint64_t debug_cache_hits;
+    uint64_t const_learned;
+    uint64_t const_hits;
+    uint64_t const_validations;
+    uint64_t const_mismatches;
+    uint64_t pci_combined;
+    uint64_t pci_hits;
+    uint64_t pci_absent;
+    uint64_t macro_runs;
+    uint64_t macro_commands;
+    uint64_t compressed_bytes;
+    uint64_t compressed_chars;
+    uint64_t lockstep_divergences;
+    uint64_t frame_timeouts;
+    uint64_t frame_corrupt;
+    uint64_t frame_retransmits;
+} SerialICE_stats;
+
+extern SerialICE_stats serialice_stats;
+
+void hmp_info_serialice(Monitor *mon, const QDict *qdict);
+void hmp_serialice_profile(Monitor *mon, const QDict *qdict);
+void hmp_info_serialice_profile(Monitor *mon, const QDict *qdict);
+void hmp_serialice_function_profile(Monitor *mon, const QDict *qdict);
+void hmp_info_serialice_functions(Monitor *mon, const QDict *qdict);
+void hmp_serialice_heatmap(Monitor *mon, const QDict *qdict);
+void hmp_info_serialice_heatmap(Monitor *mon, const QDict *qdict);
+
 #endif
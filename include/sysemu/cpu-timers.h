@@ -69,6 +69,9 @@ void icount_notify_exit(void);
 void cpu_enable_ticks(void);
 /* Caller must hold BQL */
 void cpu_disable_ticks(void);
+/* Freeze VM time while a vCPU waits outside the VM, BQL not needed */
+void cpu_pause_ticks(void);
+void cpu_resume_ticks(void);
 
 /*
  * return the time elapsed in VM between vm_start and vm_stop.
@@ -168,6 +168,12 @@ void replay_audio_out(size_t *played);
 /*! Saves/restores recorded samples of audio in operation. */
 void replay_audio_in(size_t *recorded, void *samples, size_t *wpos, size_t size);
 
+/* SerialICE */
+
+/*! Saves/restores a reply of the SerialICE target.
+    @len is the size of the reply in @buf, updated when replaying. */
+void replay_serialice_reply(char *buf, size_t *len);
+
 /* VM state operations */
 
 /*! Called at the start of execution.
@@ -389,6 +389,29 @@ void qemu_plugin_vcpu_syscall_ret(CPUState *cpu, int64_t num, int64_t ret)
     }
 }
 
+/*
+ * Disable CFI checks.
+ * The callback function has been loaded from an external library so we do not
+ * have type information
+ */
+QEMU_DISABLE_CFI
+void qemu_plugin_vcpu_serialice_cb(CPUState *cpu,
+                                   const struct qemu_plugin_serialice_transaction *tx)
+{
+    struct qemu_plugin_cb *cb, *next;
+    enum qemu_plugin_event ev = QEMU_PLUGIN_EV_VCPU_SERIALICE;
+
+    if (!test_bit(ev, cpu->plugin_mask)) {
+        return;
+    }
+
+    QLIST_FOREACH_SAFE_RCU(cb, &plugin.cb_lists[ev], entry, next) {
+        qemu_plugin_serialice_cb_t func = cb->f.serialice;
+
+        func(cb->ctx->id, cpu->cpu_index, tx);
+    }
+}
+
 void qemu_plugin_vcpu_idle_cb(CPUState *cpu)
 {
     plugin_vcpu_cb__simple(cpu, QEMU_PLUGIN_EV_VCPU_IDLE);
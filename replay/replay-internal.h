@@ -50,6 +50,8 @@ enum ReplayEvents {
     EVENT_AUDIO_IN,
     /* for random number generator */
     EVENT_RANDOM,
+    /* for SerialICE target replies */
+    EVENT_SERIALICE,
     /* for clock read/writes */
     /* some of greater codes are reserved for clocks */
     EVENT_CLOCK,
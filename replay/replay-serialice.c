@@ -0,0 +1,32 @@
+/*
+ * replay-serialice.c
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "sysemu/replay.h"
+#include "replay-internal.h"
+
+void replay_serialice_reply(char *buf, size_t *len)
+{
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        g_assert(replay_mutex_locked());
+        replay_save_instructions();
+        replay_put_event(EVENT_SERIALICE);
+        replay_put_array((const uint8_t *)buf, *len);
+    } else if (replay_mode == REPLAY_MODE_PLAY) {
+        g_assert(replay_mutex_locked());
+        replay_account_executed_instructions();
+        if (replay_next_event_is(EVENT_SERIALICE)) {
+            replay_get_array((uint8_t *)buf, len);
+            replay_finish_event();
+        } else {
+            error_report("Missing SerialICE reply event in the replay log");
+            abort();
+        }
+    }
+}
@@ -21,6 +21,9 @@ void replay_audio_in(size_t *recorded, void *samples, size_t *wpos, size_t size)
 void replay_audio_out(size_t *played)
 {
 }
+void replay_serialice_reply(char *buf, size_t *len)
+{
+}
 void replay_breakpoint(void)
 {
 }
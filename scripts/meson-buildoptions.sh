@@ -70,6 +70,8 @@ meson_options_help() {
   printf "%s\n" '                           "manufacturer" name for qemu-ga registry entries'
   printf "%s\n" '                           [QEMU]'
   printf "%s\n" '  --qemu-ga-version=VALUE  version number for qemu-ga installer'
+  printf "%s\n" '  --serialice-lua=CHOICE   Lua implementation for SerialICE scripts [lua53]'
+  printf "%s\n" '                           (choices: lua53/luajit)'
   printf "%s\n" '  --smbd=VALUE             Path to smbd for slirp networking'
   printf "%s\n" '  --sysconfdir=VALUE       Sysconf data directory [etc]'
   printf "%s\n" '  --tls-priority=VALUE     Default TLS protocol/cipher priority string'
@@ -470,6 +472,7 @@ _meson_option_parse() {
     --disable-selinux) printf "%s" -Dselinux=disabled ;;
     --enable-serialice) printf "%s" -Dserialice=enabled ;;
     --disable-serialice) printf "%s" -Dserialice=disabled ;;
+    --serialice-lua=*) quote_sh "-Dserialice_lua=$2" ;;
     --enable-slirp) printf "%s" -Dslirp=enabled ;;
     --disable-slirp) printf "%s" -Dslirp=disabled ;;
     --enable-slirp-smbd) printf "%s" -Dslirp_smbd=enabled ;;
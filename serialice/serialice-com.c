@@ -39,7 +39,10 @@
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/crc-ccitt.h"
 #include "qapi/error.h"
+#include "qapi/qapi-events-serialice-target.h"
 #include "migration/vmstate.h"
 #include "hw/qdev-properties.h"
 #include "hw/qdev-properties-system.h"
@@ -47,14 +50,47 @@
 #include "hw/hyperv/vmbus.h"
 #include "hw/hyperv/vmbus-bridge.h"
 #include "hw/sysbus.h"
+#include "sysemu/cpu-timers.h"
+#include "sysemu/replay.h"
 #include "serialice.h"
+#include "trace.h"
 
-#define SERIALICE_DEBUG 3
 #define BUFFER_SIZE 1024
+/* Largest block transfer payload, sent as two hex digits per byte */
+#define BLOCK_SIZE 256
 
 const char *serialice_device;
 
-typedef struct {
+/* The target shell understands the *rb/*wb block transfer extension */
+int serialice_block_transfers = 0;
+
+/* The target shell understands the *rz compressed block read extension */
+int serialice_compressed_transfers = 0;
+
+/* The target shell understands the *rp/*wp PCI configuration extension */
+int serialice_pci_commands = 0;
+
+/* The target shell understands the *xd/*xr macro extension */
+int serialice_target_macros = 0;
+
+/* The target shell understands *F framed commands */
+int serialice_framed_transfers = 0;
+
+/* Stop guest time while waiting for the target */
+int serialice_virtual_time = 0;
+
+/* Back to the plain protocol, for a script that didn't ask for more */
+void serialice_serial_script_reset(void)
+{
+    serialice_block_transfers = 0;
+    serialice_compressed_transfers = 0;
+    serialice_pci_commands = 0;
+    serialice_target_macros = 0;
+    serialice_framed_transfers = 0;
+    serialice_virtual_time = 0;
+}
+
+struct SerialICEState {
 #ifdef WIN32
     HANDLE fd;
 #else
@@ -62,19 +98,46 @@ typedef struct {
 #endif
     char *buffer;
     char *command;
-} SerialICEState;
+    int handshake_mode;
+    int prompt_pending;         // a prompt was consumed but not answered
+    int framed;                 // commands are framed, reads time out
+    int unframed;               // the next reply has no fixed length
+    uint8_t seq;                // of the next framed command
+};
 
-static SerialICEState *s;
+/* The target the guest runs on */
+static SerialICEState *primary;
+/* Further targets are driven by their own thread, which binds them */
+static __thread SerialICEState *bound;
 static const SerialICE_target serialice_protocol;
 const char *serialice_mainboard = NULL;
-
-#ifndef WIN32
-static struct termios options;
-#endif
+const char *serialice_version = NULL;
 
 // **************************************************************************
 // low level communication with the SerialICE shell (serial communication)
-static int handshake_mode = 0;
+
+static SerialICEState *serial_state(void)
+{
+    return bound ? bound : primary;
+}
+
+static void transport_error(bool fatal, const char *fmt, ...)
+    G_GNUC_PRINTF(2, 3);
+
+/* Tell management applications about communication problems, before
+ * exiting if the error is fatal.
+ */
+static void transport_error(bool fatal, const char *fmt, ...)
+{
+    g_autofree char *message = NULL;
+    va_list ap;
+
+    va_start(ap, fmt);
+    message = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+
+    qapi_event_send_serialice_transport_error(message, fatal);
+}
 
 static void *mallocz(unsigned int size)
 {
@@ -106,6 +169,11 @@ static int serialice_read(SerialICEState * state, void *buf, size_t nbyte)
         if (ret == -1) {
             break;
         }
+
+        /* framed commands recover from a timeout instead of waiting on */
+        if (ret == 0 && state->framed) {
+            break;
+        }
 #endif
 
         bytes_read += ret;
@@ -119,10 +187,12 @@ static int serialice_read(SerialICEState * state, void *buf, size_t nbyte)
     return bytes_read;
 }
 
+/* @return @nbyte, or -1 if a framed command's echo timed out */
 static int serialice_write(SerialICEState * state, const void *buf,
                            size_t nbyte)
 {
     char *buffer = (char *)buf;
+    bool reported = false;
     char c;
     int i;
 
@@ -137,18 +207,29 @@ static int serialice_write(SerialICEState * state, const void *buf,
             ReadFile(state->fd, &c, 1, &ret, NULL);
         }
 #else
+        int ret;
+
         while (write(state->fd, buffer + i, 1) != 1) ;
-        while (read(state->fd, &c, 1) != 1) ;
+        while ((ret = read(state->fd, &c, 1)) != 1) {
+            /* framed commands are sent again when the echo is lost */
+            if (ret == 0 && state->framed) {
+                return -1;
+            }
+        }
 #endif
-        if (c != buffer[i] && !handshake_mode) {
-            printf("Readback error! %x/%x\n", c, buffer[i]);
+        if (c != buffer[i] && !state->handshake_mode) {
+            trace_serialice_readback_error(c, buffer[i]);
+            if (!reported) {
+                transport_error(false, "Readback error: %x/%x", c, buffer[i]);
+                reported = true;
+            }
         }
     }
 
     return nbyte;
 }
 
-static int serialice_wait_prompt(void)
+static int serialice_wait_prompt(SerialICEState * s)
 {
     char buf[3];
     int l;
@@ -157,8 +238,13 @@ static int serialice_wait_prompt(void)
 
     if (l == -1) {
         perror("SerialICE: Could not read from target");
+        transport_error(true, "Could not read from target: %s",
+                        strerror(errno));
         exit(1);
     }
+    if (l != 3) {
+        return -1;
+    }
 
     while (buf[0] != '\n' || buf[1] != '>' || buf[2] != ' ') {
         buf[0] = buf[1];
@@ -166,23 +252,27 @@ static int serialice_wait_prompt(void)
         l = serialice_read(s, buf + 2, 1);
         if (l == -1) {
             perror("SerialICE: Could not read from target");
+            transport_error(true, "Could not read from target: %s",
+                            strerror(errno));
             exit(1);
         }
+        if (l != 1) {
+            return -1;
+        }
     }
 
     return 0;
 }
 
-const SerialICE_target *serialice_serial_init(void)
+static SerialICEState *serial_open(const char *device)
 {
-    s = mallocz(sizeof(SerialICEState));
+    SerialICEState *s = mallocz(sizeof(SerialICEState));
+#ifndef WIN32
+    struct termios options;
+#endif
 
-    if (serialice_device == NULL) {
-        printf("You need to specify a serial device to use SerialICE.\n");
-        exit(1);
-    }
 #ifdef WIN32
-    s->fd = CreateFile(serialice_device, GENERIC_READ | GENERIC_WRITE,
+    s->fd = CreateFile(device, GENERIC_READ | GENERIC_WRITE,
                        0, NULL, OPEN_EXISTING, 0, NULL);
 
     if (s->fd == INVALID_HANDLE_VALUE) {
@@ -206,7 +296,7 @@ const SerialICE_target *serialice_serial_init(void)
         exit(1);
     }
 #else
-    s->fd = open(serialice_device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    s->fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
     if (s->fd == -1) {
         perror("SerialICE: Could not connect to target TTY");
@@ -249,43 +339,108 @@ const SerialICE_target *serialice_serial_init(void)
 
     printf("SerialICE: Waiting for handshake with target... ");
 
-    handshake_mode = 1;         // Readback errors are to be expected in this phase.
+    s->handshake_mode = 1;      // Readback errors are to be expected in this phase.
 
     /* Trigger a prompt */
     serialice_write(s, "@", 1);
 
     /* ... and wait for it to appear */
-    if (serialice_wait_prompt() == 0) {
+    if (serialice_wait_prompt(s) == 0) {
         printf("target alive!\n");
     } else {
         printf("target not ok!\n");
         exit(1);
     }
 
-    /* Each serialice_command() waits for a prompt, so trigger one for the
-     * first command, as we consumed the last one for the handshake
+    /* Each serialice_command() waits for a prompt. We consumed the last
+     * one for the handshake, so let the first command go out right away
+     * instead of triggering another prompt.
      */
-    serialice_write(s, "@", 1);
+    s->prompt_pending = 1;
 
-    handshake_mode = 0;         // from now on, warn about readback errors.
+    s->handshake_mode = 0;      // from now on, warn about readback errors.
+    return s;
+}
+
+const SerialICE_target *serialice_serial_init(void)
+{
+    if (serialice_device == NULL) {
+        printf("You need to specify a serial device to use SerialICE.\n");
+        exit(1);
+    }
+
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        /* All replies come from the replay log, leave the target alone */
+        primary = mallocz(sizeof(SerialICEState));
+        primary->buffer = mallocz(BUFFER_SIZE);
+        primary->command = mallocz(BUFFER_SIZE);
+        printf("SerialICE: Replaying target replies from the log\n");
+        return &serialice_protocol;
+    }
+
+    primary = serial_open(serialice_device);
+    return &serialice_protocol;
+}
+
+/* Open another target on @device. It is only talked to through the
+ * returned protocol by the thread that bound it with
+ * serialice_serial_bind(), and is neither recorded nor counted in the
+ * statistics.
+ */
+const SerialICE_target *serialice_serial_open(const char *device,
+                                              SerialICEState ** state)
+{
+    *state = serial_open(device);
     return &serialice_protocol;
 }
 
+void serialice_serial_bind(SerialICEState * state)
+{
+    bound = state;
+}
+
 void serialice_serial_exit(void)
 {
-    free(s->command);
-    free(s->buffer);
-    free(s);
+    free(primary->command);
+    free(primary->buffer);
+    free(primary);
 }
 
-static void serialice_command(const char *command, int reply_len)
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* @return the byte in two hex digits at @p or -1 */
+static int hex_byte(const char *p)
+{
+    int hi = hex_digit(p[0]), lo = hex_digit(p[1]);
+
+    if (hi < 0 || lo < 0) {
+        return -1;
+    }
+    return hi << 4 | lo;
+}
+
+static void plain_command(SerialICEState * s, const char *command,
+                          int reply_len)
 {
-#if SERIALICE_DEBUG > 5
-    int i;
-#endif
     int l;
 
-    serialice_wait_prompt();
+    if (s->prompt_pending) {
+        s->prompt_pending = 0;
+    } else {
+        serialice_wait_prompt(s);
+    }
 
     serialice_write(s, command, strlen(command));
 
@@ -295,6 +450,8 @@ static void serialice_command(const char *command, int reply_len)
 
     if (l == -1) {
         perror("SerialICE: Could not read from target");
+        transport_error(true, "Could not read from target: %s",
+                        strerror(errno));
         exit(1);
     }
     // compensate for CR on the wire. Needed on Win32
@@ -306,14 +463,263 @@ static void serialice_command(const char *command, int reply_len)
     if (l != reply_len) {
         printf("SerialICE: command was not answered sufficiently: "
                "(%d/%d bytes)\n'%s'\n", l, reply_len, s->buffer);
+        transport_error(true, "Command was not answered sufficiently "
+                        "(%d/%d bytes)", l, reply_len);
         exit(1);
     }
-#if SERIALICE_DEBUG > 5
-    for (i = 0; i < reply_len; i++) {
-        printf("%02x ", s->buffer[i]);
+}
+
+// **************************************************************************
+// framed commands for unreliable links
+
+/* Framed commands are sent as *F<ss><cccc> followed by the command without
+ * its '*', with sequence number ss and the CRC-16/CCITT-FALSE cccc of the
+ * whole command. The shell drops a garbled command. Otherwise it answers
+ * as usual and appends .<ss><cccc>, with the CRC of that answer.
+ *
+ * A command repeating the sequence number of the last one is answered
+ * from the shell's copy of the last reply without running it again, so
+ * any command, not only side effect free reads, can be sent again when
+ * its reply was lost. *Fr makes the shell forget the last command.
+ */
+#define FRAME_TRAILER	7
+#define FRAME_RETRIES	8
+#define FRAME_TIMEOUT	10      // deciseconds without a character
+
+/* Outcome of a framed exchange */
+#define FRAME_OK	0
+#define FRAME_LOST	1       // prompt or reply missing or short
+#define FRAME_CORRUPT	2       // reply failed its check
+
+static uint16_t frame_crc(const char *p, int len)
+{
+    return crc_ccitt_false(0xffff, (const uint8_t *)p, len);
+}
+
+/* Let reads time out quickly while framed, so lost characters are
+ * noticed and sent again.
+ */
+static void frame_switch(SerialICEState * s, int on)
+{
+#ifndef WIN32
+    struct termios options;
+
+    if (tcgetattr(s->fd, &options) == 0) {
+        options.c_cc[VTIME] = on ? FRAME_TIMEOUT : 100;
+        tcsetattr(s->fd, TCSANOW, &options);
     }
-    printf("\n");
 #endif
+
+    if (on) {
+        plain_command(s, "*Fr", 0);
+        s->seq = 0;
+    }
+    s->framed = on;
+}
+
+/* Get back in step with the shell after a lost or garbled frame: trigger
+ * a prompt and wait until the line is quiet with the prompt being the
+ * last thing the shell sent.
+ *
+ * @return 0 once in step
+ */
+static int frame_resync(SerialICEState * s)
+{
+    char buf[3];
+    char c;
+    int tries;
+
+    s->handshake_mode = 1;      // the echo may be lost as well
+    for (tries = 0; tries < FRAME_RETRIES; tries++) {
+        memset(buf, 0, sizeof(buf));
+        /* even without its echo, the prompt may still come */
+        serialice_write(s, "@", 1);
+        while (serialice_read(s, &c, 1) == 1) {
+            buf[0] = buf[1];
+            buf[1] = buf[2];
+            buf[2] = c;
+        }
+        if (buf[0] == '\n' && buf[1] == '>' && buf[2] == ' ') {
+            s->handshake_mode = 0;
+            s->prompt_pending = 1;
+            return 0;
+        }
+    }
+    s->handshake_mode = 0;
+    return -1;
+}
+
+/* @return FRAME_* */
+static int frame_exchange(SerialICEState * s, const char *command,
+                          int reply_len)
+{
+    char header[9];
+    int l, seq, hi, lo;
+
+    if (s->prompt_pending) {
+        s->prompt_pending = 0;
+    } else if (serialice_wait_prompt(s)) {
+        return FRAME_LOST;
+    }
+
+    sprintf(header, "*F%02x%04x", s->seq, frame_crc(command, strlen(command)));
+    if (serialice_write(s, header, 8) < 0 ||
+        serialice_write(s, command + 1, strlen(command + 1)) < 0) {
+        return FRAME_LOST;
+    }
+
+    memset(s->buffer, 0, reply_len + FRAME_TRAILER + 1);
+    l = serialice_read(s, s->buffer, reply_len + FRAME_TRAILER);
+    if (l == -1) {
+        perror("SerialICE: Could not read from target");
+        transport_error(true, "Could not read from target: %s",
+                        strerror(errno));
+        exit(1);
+    }
+    // compensate for CR on the wire. Needed on Win32
+    if (l && s->buffer[0] == '\r') {
+        memmove(s->buffer, s->buffer + 1, l - 1);
+        l += serialice_read(s, s->buffer + l - 1, 1) - 1;
+    }
+    if (l != reply_len + FRAME_TRAILER) {
+        return FRAME_LOST;
+    }
+
+    seq = hex_byte(s->buffer + reply_len + 1);
+    hi = hex_byte(s->buffer + reply_len + 3);
+    lo = hex_byte(s->buffer + reply_len + 5);
+    if (s->buffer[reply_len] != '.' || seq != s->seq || hi < 0 || lo < 0 ||
+        (hi << 8 | lo) != frame_crc(s->buffer, reply_len)) {
+        return FRAME_CORRUPT;
+    }
+
+    s->buffer[reply_len] = '\0';
+    return FRAME_OK;
+}
+
+static void frame_command(SerialICEState * s, const char *command,
+                          int reply_len, bool account)
+{
+    int tries, ret;
+
+    for (tries = 0;; tries++) {
+        ret = frame_exchange(s, command, reply_len);
+        if (ret == FRAME_OK) {
+            break;
+        }
+
+        if (account && ret == FRAME_LOST) {
+            serialice_stats.frame_timeouts++;
+        } else if (account) {
+            serialice_stats.frame_corrupt++;
+        }
+        trace_serialice_frame_error(command, ret == FRAME_LOST ?
+                                    "lost" : "corrupt", tries);
+
+        if (tries == FRAME_RETRIES || frame_resync(s)) {
+            printf("SerialICE: command %s failed %d times\n", command,
+                   tries + 1);
+            transport_error(true, "Command %s failed %d times", command,
+                            tries + 1);
+            exit(1);
+        }
+        if (account) {
+            serialice_stats.frame_retransmits++;
+        }
+    }
+    s->seq++;
+}
+
+// **************************************************************************
+// commands to the SerialICE shell
+
+static void serialice_command(const char *command, int reply_len)
+{
+    SerialICEState *s = serial_state();
+    /* Further targets run alongside the primary one, which alone stops
+     * guest time and goes to the replay log and the statistics.
+     */
+    bool account = s == primary;
+    int framed = serialice_framed_transfers && !s->unframed;
+    size_t len = reply_len;
+    int64_t start = get_clock(), elapsed;
+
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        trace_serialice_command_send(command);
+        replay_serialice_reply(s->buffer, &len);
+        s->buffer[len] = '\0';
+        serialice_stats.commands++;
+        trace_serialice_command_reply(s->buffer, 0);
+        return;
+    }
+
+    /* With icount, guest time only advances with executed instructions
+     * already, otherwise freeze it so delay loops see no wire time.
+     */
+    if (account && serialice_virtual_time && !icount_enabled()) {
+        cpu_pause_ticks();
+    }
+
+    if (framed != s->framed) {
+        frame_switch(s, framed);
+    }
+
+    trace_serialice_command_send(command);
+    if (framed) {
+        frame_command(s, command, reply_len, account);
+    } else {
+        plain_command(s, command, reply_len);
+    }
+
+    elapsed = get_clock() - start;
+    trace_serialice_command_reply(s->buffer, elapsed);
+    if (!account) {
+        return;
+    }
+
+    if (serialice_virtual_time && !icount_enabled()) {
+        cpu_resume_ticks();
+    }
+    replay_serialice_reply(s->buffer, &len);
+
+    serialice_stats.commands++;
+    serialice_stats.wire_ns += elapsed;
+}
+
+/* Read the @len characters following a reply whose header told how
+ * long the rest is. They go to the buffer after the header at @offset.
+ */
+static void serialice_read_reply(int offset, int len)
+{
+    SerialICEState *s = serial_state();
+    bool account = s == primary;
+    size_t l = len;
+    int64_t start = get_clock();
+
+    if (replay_mode != REPLAY_MODE_PLAY) {
+        if (account && serialice_virtual_time && !icount_enabled()) {
+            cpu_pause_ticks();
+        }
+
+        if (serialice_read(s, s->buffer + offset, len) != len) {
+            printf("SerialICE: reply was not complete\n");
+            transport_error(true, "Reply was not complete (%d bytes "
+                            "expected)", len);
+            exit(1);
+        }
+
+        if (account && serialice_virtual_time && !icount_enabled()) {
+            cpu_resume_ticks();
+        }
+    }
+    if (!account) {
+        s->buffer[offset + len] = '\0';
+        return;
+    }
+    replay_serialice_reply(s->buffer + offset, &l);
+    s->buffer[offset + l] = '\0';
+
+    serialice_stats.wire_ns += get_clock() - start;
 }
 
 // **************************************************************************
@@ -321,23 +727,38 @@ static void serialice_command(const char *command, int reply_len)
 
 static void msg_version(void)
 {
+    SerialICEState *s = serial_state();
     int len = 0;
+    size_t line_len;
+
     printf("SerialICE: Version.....: ");
+
+    /* The version line has no fixed length, so it is not framed but read
+     * and recorded on its own.
+     */
+    s->unframed = 1;
     serialice_command("*vi", 0);
+    s->unframed = 0;
 
     memset(s->buffer, 0, BUFFER_SIZE);
-    serialice_read(s, s->buffer, 1);
-    serialice_read(s, s->buffer, 1);
-    while (s->buffer[len++] != '\n') {
-        serialice_read(s, s->buffer + len, 1);
+    if (replay_mode != REPLAY_MODE_PLAY) {
+        serialice_read(s, s->buffer, 1);
+        serialice_read(s, s->buffer, 1);
+        while (s->buffer[len++] != '\n') {
+            serialice_read(s, s->buffer + len, 1);
+        }
+        s->buffer[len - 1] = '\0';
     }
-    s->buffer[len - 1] = '\0';
+    line_len = len;
+    replay_serialice_reply(s->buffer, &line_len);
 
-    printf("%s\n", s->buffer);
+    serialice_version = strdup(s->buffer);
+    printf("%s\n", serialice_version);
 }
 
 static void msg_mainboard(void)
 {
+    SerialICEState *s = serial_state();
     int len = 31;
 
     printf("SerialICE: Mainboard...: ");
@@ -351,6 +772,8 @@ static void msg_mainboard(void)
 
 static uint64_t msg_io_read(uint16_t port, unsigned int size)
 {
+    SerialICEState *s = serial_state();
+
     switch (size) {
     case 1:
         sprintf(s->command, "*ri%04x.b", port);
@@ -375,6 +798,8 @@ static uint64_t msg_io_read(uint16_t port, unsigned int size)
 
 static void msg_io_write(uint16_t port, unsigned int size, uint64_t data)
 {
+    SerialICEState *s = serial_state();
+
     switch (size) {
     case 1:
         sprintf(s->command, "*wi%04x.b=%02x", port, (uint8_t) data);
@@ -394,8 +819,45 @@ static void msg_io_write(uint16_t port, unsigned int size, uint64_t data)
     return;
 }
 
+static const char pci_size_char[] = { [1] = 'b', [2] = 'w', [4] = 'l' };
+
+/* Combined 0xcf8/0xcfc accesses: @addr is the 0xcf8 value with the
+ * offset into the 0xcfc data window in its low two bits.
+ */
+static uint64_t msg_pci_read(uint32_t addr, unsigned int size)
+{
+    SerialICEState *s = serial_state();
+
+    if (!serialice_pci_commands || size > 4 || !pci_size_char[size]) {
+        msg_io_write(0xcf8, 4, addr & ~3);
+        return msg_io_read(0xcfc + (addr & 3), size);
+    }
+
+    sprintf(s->command, "*rp%08x.%c", addr, pci_size_char[size]);
+    // command read back: "\n" followed by two hex digits per byte
+    serialice_command(s->command, 2 * size + 1);
+    return strtoul(s->buffer + 1, (char **)NULL, 16);
+}
+
+static void msg_pci_write(uint32_t addr, unsigned int size, uint64_t data)
+{
+    SerialICEState *s = serial_state();
+
+    if (!serialice_pci_commands || size > 4 || !pci_size_char[size]) {
+        msg_io_write(0xcf8, 4, addr & ~3);
+        msg_io_write(0xcfc + (addr & 3), size, data);
+        return;
+    }
+
+    sprintf(s->command, "*wp%08x.%c=%0*x", addr, pci_size_char[size],
+            2 * size, (uint32_t)data);
+    serialice_command(s->command, 0);
+}
+
 static uint64_t msg_load(uint32_t addr, unsigned int size)
 {
+    SerialICEState *s = serial_state();
+
     switch (size) {
     case 1:
         sprintf(s->command, "*rm%08x.b", addr);
@@ -425,6 +887,8 @@ static uint64_t msg_load(uint32_t addr, unsigned int size)
 
 static void msg_store(uint32_t addr, unsigned int size, uint64_t data)
 {
+    SerialICEState *s = serial_state();
+
     switch (size) {
     case 1:
         sprintf(s->command, "*wm%08x.b=%02x", addr, (uint8_t) data);
@@ -447,8 +911,160 @@ static void msg_store(uint32_t addr, unsigned int size, uint64_t data)
     }
 }
 
+static void msg_store_block(uint32_t addr, const uint8_t * buf,
+                            unsigned int len)
+{
+    SerialICEState *s = serial_state();
+    unsigned int i, chunk, size;
+    char *p;
+
+    if (!serialice_block_transfers) {
+        // split into the largest naturally aligned single stores
+        while (len) {
+            size = 4;
+            while (size > len || (addr & (size - 1))) {
+                size >>= 1;
+            }
+            msg_store(addr, size, ldn_le_p(buf, size));
+            addr += size;
+            buf += size;
+            len -= size;
+        }
+        return;
+    }
+
+    while (len) {
+        chunk = MIN(len, BLOCK_SIZE);
+        p = s->command + sprintf(s->command, "*wb%08x.%04x=", addr, chunk);
+        for (i = 0; i < chunk; i++) {
+            p += sprintf(p, "%02x", buf[i]);
+        }
+        serialice_command(s->command, 0);
+        addr += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+/* Compressed block payloads are made of
+ *   <xx>      a literal byte in hex
+ *   R<nn><xx> byte xx repeated nn + 1 times
+ *   L<oo><nn> nn + 1 bytes copied from oo + 1 bytes back, may overlap
+ *
+ * @return 0 if @in decoded to exactly @len bytes
+ */
+static int rle_decode(const char *in, int in_len, uint8_t * buf,
+                      unsigned int len)
+{
+    unsigned int out = 0;
+    int pos = 0, a, b;
+
+    while (pos < in_len) {
+        if (in[pos] == 'R' || in[pos] == 'L') {
+            if (pos + 5 > in_len) {
+                return -1;
+            }
+            a = hex_byte(in + pos + 1);
+            b = hex_byte(in + pos + 3);
+            if (a < 0 || b < 0) {
+                return -1;
+            }
+            if (in[pos] == 'R') {
+                if (a + 1 > len - out) {
+                    return -1;
+                }
+                memset(buf + out, b, a + 1);
+                out += a + 1;
+            } else {
+                if (a + 1 > out || b + 1 > len - out) {
+                    return -1;
+                }
+                for (b++; b; b--, out++) {
+                    buf[out] = buf[out - a - 1];
+                }
+            }
+            pos += 5;
+        } else {
+            if (pos + 2 > in_len || out == len) {
+                return -1;
+            }
+            a = hex_byte(in + pos);
+            if (a < 0) {
+                return -1;
+            }
+            buf[out++] = a;
+            pos += 2;
+        }
+    }
+
+    return out == len ? 0 : -1;
+}
+
+/* @return 0 if the chunk arrived compressed and intact */
+static int msg_load_compressed(uint32_t addr, uint8_t * buf,
+                               unsigned int chunk)
+{
+    SerialICEState *s = serial_state();
+    int enc_len;
+
+    sprintf(s->command, "*rz%08x.%04x", addr, chunk);
+    // command read back: "\n" followed by the payload length in hex
+    serialice_command(s->command, 5);
+    enc_len = strtoul(s->buffer + 1, (char **)NULL, 16);
+    if (enc_len > BUFFER_SIZE - 6) {
+        printf("SerialICE: compressed block too long (%d characters)\n",
+               enc_len);
+        transport_error(true, "Compressed block too long (%d characters)",
+                        enc_len);
+        exit(1);
+    }
+    serialice_read_reply(5, enc_len);
+
+    if (rle_decode(s->buffer + 5, enc_len, buf, chunk)) {
+        transport_error(false, "Corrupt compressed block at 0x%08x", addr);
+        return -1;
+    }
+    if (s == primary) {
+        serialice_stats.compressed_bytes += chunk;
+        serialice_stats.compressed_chars += enc_len;
+    }
+    return 0;
+}
+
+static void msg_load_block(uint32_t addr, uint8_t * buf, unsigned int len)
+{
+    SerialICEState *s = serial_state();
+    unsigned int i, chunk;
+    char hex[3] = { 0 };
+
+    while (len) {
+        chunk = MIN(len, BLOCK_SIZE);
+        /* compressed replies have no fixed length to be framed */
+        if (serialice_compressed_transfers && !serialice_framed_transfers &&
+            !msg_load_compressed(addr, buf, chunk)) {
+            addr += chunk;
+            buf += chunk;
+            len -= chunk;
+            continue;
+        }
+
+        sprintf(s->command, "*rb%08x.%04x", addr, chunk);
+        // command read back: "\n" followed by two hex digits per byte
+        serialice_command(s->command, 2 * chunk + 1);
+        for (i = 0; i < chunk; i++) {
+            memcpy(hex, s->buffer + 1 + 2 * i, 2);
+            buf[i] = strtoul(hex, (char **)NULL, 16);
+        }
+        addr += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
 static void msg_rdmsr(uint32_t addr, uint32_t key, uint32_t * hi, uint32_t * lo)
 {
+    SerialICEState *s = serial_state();
+
     sprintf(s->command, "*rc%08x.%08x", addr, key);
     // command read back: "\n00000000.00000000" (18 characters)
     serialice_command(s->command, 18);
@@ -459,12 +1075,16 @@ static void msg_rdmsr(uint32_t addr, uint32_t key, uint32_t * hi, uint32_t * lo)
 
 static void msg_wrmsr(uint32_t addr, uint32_t key, uint32_t hi, uint32_t lo)
 {
+    SerialICEState *s = serial_state();
+
     sprintf(s->command, "*wc%08x.%08x=%08x.%08x", addr, key, hi, lo);
     serialice_command(s->command, 0);
 }
 
 static void msg_cpuid(uint32_t eax, uint32_t ecx, cpuid_regs_t * ret)
 {
+    SerialICEState *s = serial_state();
+
     sprintf(s->command, "*ci%08x.%08x", eax, ecx);
     // command read back: "\n000006f2.00000000.00001234.12340324"
     // (36 characters)
@@ -478,6 +1098,41 @@ static void msg_cpuid(uint32_t eax, uint32_t ecx, cpuid_regs_t * ret)
     ret->edx = (uint32_t) strtoul(s->buffer + 28, (char **)NULL, 16);
 }
 
+/* Instructions are sent as op, size, rd, rs and imm in hex, 16 digits each */
+static void msg_macro_define(int id, const SerialICE_macro_insn * code,
+                             int len)
+{
+    SerialICEState *s = serial_state();
+    char *p;
+    int i;
+
+    p = s->command + sprintf(s->command, "*xd%02x.%02x=", id, len);
+    for (i = 0; i < len; i++) {
+        p += sprintf(p, "%02x%02x%02x%02x%08x", code[i].op, code[i].size,
+                     code[i].rd, code[i].rs, code[i].imm);
+    }
+    serialice_command(s->command, 0);
+}
+
+static int msg_macro_run(int id, uint32_t * regs)
+{
+    SerialICEState *s = serial_state();
+    char hex[9] = { 0 };
+    int i;
+
+    sprintf(s->command, "*xr%02x.%08x.%08x.%08x.%08x", id,
+            regs[0], regs[1], regs[2], regs[3]);
+    // command read back: "\n00.00000000.00000000.00000000.00000000"
+    // (39 characters)
+    serialice_command(s->command, 39);
+    for (i = 0; i < SERIALICE_MACRO_ARGS; i++) {
+        memcpy(hex, s->buffer + 4 + 9 * i, 8);
+        regs[i] = strtoul(hex, (char **)NULL, 16);
+    }
+    s->buffer[3] = 0;           // . -> \0
+    return strtoul(s->buffer + 1, (char **)NULL, 16);
+}
+
 static const SerialICE_target serialice_protocol = {
     .version = msg_version,
     .mainboard = msg_mainboard,
@@ -485,7 +1140,13 @@ static const SerialICE_target serialice_protocol = {
     .io_write = msg_io_write,
     .load = msg_load,
     .store = msg_store,
+    .store_block = msg_store_block,
+    .load_block = msg_load_block,
+    .pci_read = msg_pci_read,
+    .pci_write = msg_pci_write,
     .rdmsr = msg_rdmsr,
     .wrmsr = msg_wrmsr,
     .cpuid = msg_cpuid,
+    .macro_define = msg_macro_define,
+    .macro_run = msg_macro_run,
 };
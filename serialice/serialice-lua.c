@@ -41,66 +41,704 @@
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-serialice-target.h"
+#include "qapi/qmp/qdict.h"
+#include "monitor/monitor.h"
 #include "migration/vmstate.h"
 #include "sysemu/runstate.h"
+#include "sysemu/replay.h"
 #include "hw/qdev-properties.h"
 #include "hw/qdev-properties-system.h"
 #include "hw/hyperv/hyperv.h"
 #include "hw/hyperv/vmbus.h"
 #include "hw/hyperv/vmbus-bridge.h"
 #include "hw/sysbus.h"
+#include "hw/i386/x86.h"
 #include "cpu.h"
 #include "serialice.h"
+#include "trace.h"
+
+#if LUA_VERSION_NUM <= 501
+#define lua_rawlen lua_objlen
+#endif
 
 #define LOG_IO		1
 #define LOG_MEMORY	2
 #define LOG_MSR		4
 
+/* Lua before 5.3 and LuaJIT keep numbers as doubles, which hold 53
+ * bits. Hooks get 8 byte data there as its low half followed by its high
+ * half, and may return the high half after the data or leave it unchanged.
+ */
+#if LUA_VERSION_NUM < 503
+#define SPLIT_64BIT_DATA true
+#else
+#define SPLIT_64BIT_DATA false
+#endif
+
+/* What to do with an access whose Lua filter failed */
+#define ERROR_ROUTE_TARGET	0
+#define ERROR_ROUTE_QEMU	1
+#define ERROR_ROUTE_STOP	2
+
+enum {
+    HOOK_IO_READ_FILTER,
+    HOOK_IO_WRITE_FILTER,
+    HOOK_MEMORY_READ_FILTER,
+    HOOK_MEMORY_WRITE_FILTER,
+    HOOK_MSR_READ_FILTER,
+    HOOK_MSR_WRITE_FILTER,
+    HOOK_CPUID_FILTER,
+    HOOK_IO_READ_LOG,
+    HOOK_IO_WRITE_LOG,
+    HOOK_MEMORY_READ_LOG,
+    HOOK_MEMORY_WRITE_LOG,
+    HOOK_MSR_READ_LOG,
+    HOOK_MSR_WRITE_LOG,
+    HOOK_CPUID_LOG,
+    NUM_HOOKS
+};
+
+static const char *const hook_names[NUM_HOOKS] = {
+    [HOOK_IO_READ_FILTER] = "SerialICE_io_read_filter",
+    [HOOK_IO_WRITE_FILTER] = "SerialICE_io_write_filter",
+    [HOOK_MEMORY_READ_FILTER] = "SerialICE_memory_read_filter",
+    [HOOK_MEMORY_WRITE_FILTER] = "SerialICE_memory_write_filter",
+    [HOOK_MSR_READ_FILTER] = "SerialICE_msr_read_filter",
+    [HOOK_MSR_WRITE_FILTER] = "SerialICE_msr_write_filter",
+    [HOOK_CPUID_FILTER] = "SerialICE_cpuid_filter",
+    [HOOK_IO_READ_LOG] = "SerialICE_io_read_log",
+    [HOOK_IO_WRITE_LOG] = "SerialICE_io_write_log",
+    [HOOK_MEMORY_READ_LOG] = "SerialICE_memory_read_log",
+    [HOOK_MEMORY_WRITE_LOG] = "SerialICE_memory_write_log",
+    [HOOK_MSR_READ_LOG] = "SerialICE_msr_read_log",
+    [HOOK_MSR_WRITE_LOG] = "SerialICE_msr_write_log",
+    [HOOK_CPUID_LOG] = "SerialICE_cpuid_log",
+};
+
 static lua_State *L;
-extern char *serialice_mainboard;
 extern int serialice_rom_size;
 static const SerialICE_filter lua_ops;
 static CPUX86State *env;
 
+static int error_route = ERROR_ROUTE_STOP;
+static GHashTable *reported_errors;
+
+/* Hook profiling */
+typedef struct {
+    uint64_t calls;
+    int64_t total_ns;
+    int64_t max_ns;
+} HookProfile;
+
+static bool profiling;
+static HookProfile hook_profile[NUM_HOOKS];
+static GHashTable *line_samples;   /* "source:line" -> sample count */
+static int sample_count;
+
+/* Transaction handed to hooks through the LuaJIT FFI as SerialICE_tx,
+ * instead of pushing arguments and results through the Lua stack.
+ * Keep in sync with ffi_setup below.
+ */
+typedef struct {
+    uint64_t addr;      /* port, address, MSR or CPUID leaf */
+    uint64_t data;      /* value, MSR as hi:lo or CPUID subleaf */
+    uint32_t size;      /* access size in bytes */
+    uint32_t route;     /* READ_FROM_* / WRITE_TO_* set by filters */
+    uint32_t regs[4];   /* CPUID result eax, ebx, ecx, edx */
+} SerialICE_transaction;
+
+static SerialICE_transaction tx;
+
+/* Routes compiled from the SerialICE_routes table. Segment i covers
+ * [bounds[i], bounds[i + 1]) and bounds[0] is always 0.
+ */
+typedef struct {
+    uint64_t *bounds;
+    uint8_t *routes;    /* ROUTE_*, ROUTE_FILTER enters Lua */
+    int *handlers;      /* custom filter registry refs or LUA_NOREF */
+    size_t count;
+} RouteTable;
+
+static RouteTable io_routes, memory_routes;
+
+/* The last memory access was routed by a compiled rule: don't log it */
+static bool skip_log;
+
+/* Size of the last memory read, for its logger */
+static int memory_read_size;
+
+#ifdef CONFIG_SERIALICE_LUAJIT
+static const char ffi_setup[] =
+    "local ffi = require('ffi')\n"
+    "ffi.cdef[[\n"
+    "typedef struct {\n"
+    "    uint64_t addr;\n"
+    "    uint64_t data;\n"
+    "    uint32_t size;\n"
+    "    uint32_t route;\n"
+    "    uint32_t regs[4];\n"
+    "} SerialICE_transaction;\n"
+    "enum { SERIALICE_QEMU = 1, SERIALICE_TARGET = 2 };\n"
+    "]]\n"
+    "SerialICE_tx = ffi.cast('SerialICE_transaction *', ...)\n";
+
+static bool use_ffi;
+#else
+#define use_ffi false
+#endif
+
 // **************************************************************************
 // LUA scripting interface and callbacks
 
-static int serialice_register_physical(lua_State * luastate)
+/* Back guest memory with local RAM, optionally from a memory backend
+ * object such as memory-backend-memfd with hugetlb=on:
+ * SerialICE_register_physical(<addr>, <size>[, <memdev>[, <offset>]])
+ * Only allowed while the script loads. Ranges that touch are merged.
+ */
+static int serialice_lua_register_physical(lua_State * luastate)
 {
-    int n = lua_gettop(luastate);
-    static uint8_t num = 1;
-    uint32_t addr, size;
-    MemoryRegion *phys;
-    MemoryRegion *rom_memory = get_system_memory();
-    char ram_name[16];
+    uint64_t addr = luaL_checkinteger(luastate, 1);
+    uint64_t size = luaL_checkinteger(luastate, 2);
+    const char *memdev = luaL_optstring(luastate, 3, NULL);
+    uint64_t offset = luaL_optinteger(luastate, 4, 0);
+    Error *err = NULL;
+
+    if (serialice_register_ram(addr, size, memdev, offset, &err)) {
+        lua_pushstring(luastate, error_get_pretty(err));
+        error_free(err);
+        return lua_error(luastate);
+    }
+    return 0;
+}
 
-    if (n != 2) {
-        fprintf(stderr,
-                "ERROR: Not called as SerialICE_register_physical(<addr> <size>)\n");
-        return 0;
+static int serialice_system_reset(lua_State * luastate)
+{
+    printf("Rebooting the emulated host CPU\n");
+    qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
+    return 0;
+}
+
+/* Select how accesses are routed when their filter raises an error:
+ * "target" and "qemu" send them to one side only, "stop" sends them to
+ * the target and pauses the VM so the script can be fixed.
+ */
+static int serialice_set_error_route(lua_State * luastate)
+{
+    const char *route = luaL_checkstring(luastate, 1);
+
+    if (strcmp(route, "target") == 0) {
+        error_route = ERROR_ROUTE_TARGET;
+    } else if (strcmp(route, "qemu") == 0) {
+        error_route = ERROR_ROUTE_QEMU;
+    } else if (strcmp(route, "stop") == 0) {
+        error_route = ERROR_ROUTE_STOP;
+    } else {
+        return luaL_error(luastate, "No such error route: %s", route);
+    }
+    return 0;
+}
+
+static int parse_route(const char *route)
+{
+    if (strcmp(route, "qemu") == 0) {
+        return ROUTE_QEMU;
+    } else if (strcmp(route, "target") == 0) {
+        return ROUTE_TARGET;
+    } else if (strcmp(route, "both") == 0) {
+        return ROUTE_BOTH;
+    } else if (strcmp(route, "lua") == 0) {
+        return ROUTE_FILTER;
     }
+    return -1;
+}
 
-    addr = lua_tointeger(luastate, 1);
-    size = lua_tointeger(luastate, 2);
+/* Route ports without entering Lua: SerialICE_set_io_route(first, last,
+ * route) with route "qemu", "target", "both" or "lua".
+ */
+static int serialice_lua_set_io_route(lua_State * luastate)
+{
+    lua_Integer first = luaL_checkinteger(luastate, 1);
+    lua_Integer last = luaL_checkinteger(luastate, 2);
+    int route = parse_route(luaL_checkstring(luastate, 3));
 
-    if (num > 99) {
-        fprintf(stderr,"To much memory ranges registered\n");
-        exit(1);
+    if (first < 0 || last > 0xffff || last < first) {
+        return luaL_error(luastate, "Invalid port range");
+    }
+    if (route < 0) {
+        return luaL_error(luastate, "No such route: %s",
+                          lua_tostring(luastate, 3));
     }
-    printf("Registering physical memory at 0x%08x (0x%08x bytes)\n", addr, size);
-    sprintf(ram_name, "serialice_ram%u", num);
-    phys = g_malloc(sizeof(*phys));
-    memory_region_init_ram(phys,  NULL, ram_name, size, &error_fatal);
-    memory_region_add_subregion(rom_memory, addr, phys);
-    num++;
+    serialice_set_io_route(first, last, route);
     return 0;
 }
 
-static int serialice_system_reset(lua_State * luastate)
+/* Combine sequential stores to the target in this range into block
+ * writes: SerialICE_wc_range(<addr>, <size>)
+ */
+static int serialice_lua_wc_range(lua_State * luastate)
 {
-    printf("Rebooting the emulated host CPU\n");
-    qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
+    uint32_t addr = luaL_checkinteger(luastate, 1);
+    uint32_t size = luaL_checkinteger(luastate, 2);
+
+    if (serialice_add_wc_range(addr, size)) {
+        return luaL_error(luastate, "Too many write combining ranges");
+    }
+    printf("Write combining at 0x%08x (0x%08x bytes)\n", addr, size);
+    return 0;
+}
+
+/* Reading this range has no side effects, so loads from the target may
+ * fetch more than asked for: SerialICE_readahead_range(<addr>, <size>)
+ */
+static int serialice_lua_readahead_range(lua_State * luastate)
+{
+    uint32_t addr = luaL_checkinteger(luastate, 1);
+    uint32_t size = luaL_checkinteger(luastate, 2);
+
+    if (serialice_add_ra_range(addr, size)) {
+        return luaL_error(luastate, "Too many read-ahead ranges");
+    }
+    printf("Read-ahead at 0x%08x (0x%08x bytes)\n", addr, size);
+    return 0;
+}
+
+/* The debugger may read this range from the target while the VM is
+ * stopped: SerialICE_debug_range(<addr>, <size>)
+ */
+static int serialice_lua_debug_range(lua_State * luastate)
+{
+    uint32_t addr = luaL_checkinteger(luastate, 1);
+    uint32_t size = luaL_checkinteger(luastate, 2);
+
+    if (serialice_add_debug_range(addr, size)) {
+        return luaL_error(luastate, "Too many debug ranges");
+    }
+    printf("Debugger reads at 0x%08x (0x%08x bytes)\n", addr, size);
+    return 0;
+}
+
+/* Serve target registers in ranges opted in with SerialICE_constant_range
+ * locally once they keep returning the same value:
+ * SerialICE_constant_learning(<enable>)
+ */
+static int serialice_lua_constant_learning(lua_State * luastate)
+{
+    serialice_const_learning = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Opt a range in or out of constant register learning. Only opted in
+ * ranges are learned, so opt ranges out to exclude registers in them:
+ * SerialICE_constant_range("io"|"memory", <addr>, <size>, <learn>)
+ */
+static int serialice_lua_constant_range(lua_State * luastate)
+{
+    const char *kind = luaL_checkstring(luastate, 1);
+    uint32_t addr = luaL_checkinteger(luastate, 2);
+    uint32_t size = luaL_checkinteger(luastate, 3);
+    int learn = lua_toboolean(luastate, 4);
+    int k;
+
+    if (strcmp(kind, "io") == 0) {
+        k = SERIALICE_CONST_IO;
+    } else if (strcmp(kind, "memory") == 0) {
+        k = SERIALICE_CONST_MEM;
+    } else {
+        return luaL_error(luastate, "Unknown range kind '%s'", kind);
+    }
+
+    if (serialice_add_const_range(k, addr, size, learn)) {
+        return luaL_error(luastate, "Too many constant learning ranges");
+    }
+    return 0;
+}
+
+/* Tell SerialICE whether the target shell supports combined PCI
+ * configuration cycles (*rp/*wp)
+ */
+static int serialice_lua_pci_commands(lua_State * luastate)
+{
+    serialice_pci_commands = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Cache absent functions and read-only header fields of PCI devices.
+ * Off by default, as functions hidden or disabled through memory or I/O
+ * registers keep being served from the cache:
+ * SerialICE_pci_cache(<enable>)
+ */
+static int serialice_lua_pci_cache(lua_State * luastate)
+{
+    serialice_pci_cache = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Treat memory accesses in this range as PCI configuration cycles:
+ * SerialICE_pci_ecam(<addr>, <size>)
+ */
+static int serialice_lua_pci_ecam(lua_State * luastate)
+{
+    uint32_t addr = luaL_checkinteger(luastate, 1);
+    uint32_t size = luaL_checkinteger(luastate, 2);
+
+    if (serialice_add_ecam_range(addr, size)) {
+        return luaL_error(luastate, "Too many ECAM windows");
+    }
+    printf("PCI ECAM window at 0x%08x (0x%08x bytes)\n", addr, size);
+    return 0;
+}
+
+/* Tell SerialICE whether the target shell can run macros (*xd/*xr) */
+static int serialice_lua_target_macros(lua_State * luastate)
+{
+    serialice_target_macros = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Operand layouts of macro instructions */
+enum {
+    MACRO_ALU,          // { op, rd, imm[, rs] }
+    MACRO_ACCESS,       // { op, size, rd, addr[, rs] }
+    MACRO_BRANCH,       // { op, rd, imm, label }
+    MACRO_LOOP,         // { op, rd, label }
+    MACRO_END,          // { op }
+};
+
+static const struct {
+    const char *name;
+    int op;
+    int layout;
+} macro_ops[] = {
+    { "ret", SERIALICE_MACRO_END, MACRO_END },
+    { "li", SERIALICE_MACRO_LI, MACRO_ALU },
+    { "in", SERIALICE_MACRO_IN, MACRO_ACCESS },
+    { "out", SERIALICE_MACRO_OUT, MACRO_ACCESS },
+    { "load", SERIALICE_MACRO_LOAD, MACRO_ACCESS },
+    { "store", SERIALICE_MACRO_STORE, MACRO_ACCESS },
+    { "and", SERIALICE_MACRO_AND, MACRO_ALU },
+    { "or", SERIALICE_MACRO_OR, MACRO_ALU },
+    { "xor", SERIALICE_MACRO_XOR, MACRO_ALU },
+    { "add", SERIALICE_MACRO_ADD, MACRO_ALU },
+    { "shl", SERIALICE_MACRO_SHL, MACRO_ALU },
+    { "shr", SERIALICE_MACRO_SHR, MACRO_ALU },
+    { "beq", SERIALICE_MACRO_BEQ, MACRO_BRANCH },
+    { "bne", SERIALICE_MACRO_BNE, MACRO_BRANCH },
+    { "loop", SERIALICE_MACRO_LOOP, MACRO_LOOP },
+};
+
+/* Field @field of the instruction at stack index @insn, @def if missing */
+static lua_Integer macro_field(lua_State * luastate, int insn, int field,
+                               lua_Integer def)
+{
+    lua_Integer val = def;
+
+    lua_rawgeti(luastate, insn, field);
+    if (lua_isnumber(luastate, -1)) {
+        val = lua_tointeger(luastate, -1);
+    } else if (!lua_isnil(luastate, -1) || def < 0) {
+        return luaL_error(luastate, "Macro operand %d must be a number",
+                          field - 1);
+    }
+    lua_pop(luastate, 1);
+    return val;
+}
+
+static uint8_t macro_reg(lua_State * luastate, int insn, int field,
+                         lua_Integer def)
+{
+    lua_Integer reg = macro_field(luastate, insn, field, def);
+
+    if (reg != SERIALICE_MACRO_NOREG &&
+        (reg < 0 || reg >= SERIALICE_MACRO_REGS)) {
+        return luaL_error(luastate, "Macro register %d out of range",
+                          (int)reg);
+    }
+    return reg;
+}
+
+static uint8_t macro_label(lua_State * luastate, int insn, int field,
+                           int labels)
+{
+    lua_Integer target;
+
+    lua_rawgeti(luastate, insn, field);
+    lua_rawget(luastate, labels);
+    if (!lua_isnumber(luastate, -1)) {
+        return luaL_error(luastate, "Macro operand %d must be a label",
+                          field - 1);
+    }
+    target = lua_tointeger(luastate, -1);
+    lua_pop(luastate, 1);
+    return target;
+}
+
+static void macro_insn(lua_State * luastate, int insn, int labels,
+                       SerialICE_macro_insn * out)
+{
+    const char *name;
+    lua_Integer size;
+    int i;
+
+    lua_rawgeti(luastate, insn, 1);
+    name = lua_tostring(luastate, -1);
+    for (i = 0; i < ARRAY_SIZE(macro_ops); i++) {
+        if (name && strcmp(name, macro_ops[i].name) == 0) {
+            break;
+        }
+    }
+    if (i == ARRAY_SIZE(macro_ops)) {
+        luaL_error(luastate, "Unknown macro operation '%s'",
+                   name ? name : "?");
+    }
+    lua_pop(luastate, 1);
+
+    memset(out, 0, sizeof(*out));
+    out->op = macro_ops[i].op;
+    out->rs = SERIALICE_MACRO_NOREG;
+
+    switch (macro_ops[i].layout) {
+    case MACRO_ALU:
+        out->rd = macro_reg(luastate, insn, 2, -1);
+        out->imm = macro_field(luastate, insn, 3, -1);
+        out->rs = macro_reg(luastate, insn, 4, SERIALICE_MACRO_NOREG);
+        break;
+    case MACRO_ACCESS:
+        size = macro_field(luastate, insn, 2, -1);
+        if (size != 1 && size != 2 && size != 4) {
+            luaL_error(luastate, "Macro access size must be 1, 2 or 4");
+        }
+        out->size = size;
+        out->rd = macro_reg(luastate, insn, 3, -1);
+        out->imm = macro_field(luastate, insn, 4, -1);
+        out->rs = macro_reg(luastate, insn, 5, SERIALICE_MACRO_NOREG);
+        break;
+    case MACRO_BRANCH:
+        out->rd = macro_reg(luastate, insn, 2, -1);
+        out->imm = macro_field(luastate, insn, 3, -1);
+        out->rs = macro_label(luastate, insn, 4, labels);
+        break;
+    case MACRO_LOOP:
+        out->rd = macro_reg(luastate, insn, 2, -1);
+        out->rs = macro_label(luastate, insn, 3, labels);
+        break;
+    }
+}
+
+/* Define a program of dependent target accesses that the target shell
+ * runs in a single command: <id> = SerialICE_macro({ <insn>, ... })
+ *
+ * Instructions are tables of an operation and its operands:
+ *   { "li"|"and"|"or"|"xor"|"add"|"shl"|"shr", <rd>, <imm>[, <rs>] }
+ *   { "in"|"out"|"load"|"store", <size>, <rd>, <addr>[, <rs>] }
+ *   { "beq"|"bne", <rd>, <imm>, <label> }
+ *   { "loop", <rd>, <label> }
+ *   { "ret" }
+ * Strings name the position of the next instruction. Registers are 0 to
+ * 7, an optional <rs> is added to the immediate or address. out and
+ * store write <rd>. Target writes done by macros aren't recorded for
+ * milestones.
+ */
+static int serialice_lua_macro(lua_State * luastate)
+{
+    SerialICE_macro_insn code[SERIALICE_MACRO_INSNS];
+    int i, n, labels, len = 0, id;
+
+    luaL_checktype(luastate, 1, LUA_TTABLE);
+    n = lua_rawlen(luastate, 1);
+
+    /* label -> number of the instruction following it */
+    lua_newtable(luastate);
+    labels = lua_gettop(luastate);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(luastate, 1, i);
+        if (lua_type(luastate, -1) == LUA_TSTRING) {
+            lua_pushinteger(luastate, len);
+            lua_rawset(luastate, labels);
+        } else {
+            lua_pop(luastate, 1);
+            len++;
+        }
+    }
+    if (len > SERIALICE_MACRO_INSNS) {
+        return luaL_error(luastate, "Macros are limited to %d instructions",
+                          SERIALICE_MACRO_INSNS);
+    }
+
+    len = 0;
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(luastate, 1, i);
+        if (lua_istable(luastate, -1)) {
+            macro_insn(luastate, lua_gettop(luastate), labels, &code[len++]);
+        } else if (lua_type(luastate, -1) != LUA_TSTRING) {
+            return luaL_error(luastate, "Macro entry %d is neither an "
+                              "instruction nor a label", i);
+        }
+        lua_pop(luastate, 1);
+    }
+
+    id = serialice_define_macro(code, len);
+    if (id < 0) {
+        return luaL_error(luastate, "Invalid macro or too many macros");
+    }
+    lua_pushinteger(luastate, id);
+    return 1;
+}
+
+/* Run a macro with up to four arguments in r0 to r3:
+ * <r0>, <r1>, <r2>, <r3> = SerialICE_macro_call(<id>, ...)
+ */
+static int serialice_lua_macro_call(lua_State * luastate)
+{
+    int id = luaL_checkinteger(luastate, 1);
+    uint32_t regs[SERIALICE_MACRO_ARGS];
+    int i, status;
+
+    if (!serialice_active) {
+        return luaL_error(luastate, "Macros can only run once the target "
+                          "is attached");
+    }
+
+    for (i = 0; i < SERIALICE_MACRO_ARGS; i++) {
+        regs[i] = luaL_optinteger(luastate, i + 2, 0);
+    }
+
+    status = serialice_run_macro(id, regs);
+    switch (status) {
+    case SERIALICE_MACRO_DONE:
+        break;
+    case SERIALICE_MACRO_STEP_LIMIT:
+        return luaL_error(luastate, "Macro %d ran for more than %d steps",
+                          id, SERIALICE_MACRO_MAX_STEPS);
+    case -1:
+        return luaL_error(luastate, "Unknown macro %d", id);
+    default:
+        return luaL_error(luastate, "Target failed to run macro %d "
+                          "(status %d)", id, status);
+    }
+
+    for (i = 0; i < SERIALICE_MACRO_ARGS; i++) {
+        lua_pushinteger(luastate, regs[i]);
+    }
+    return SERIALICE_MACRO_ARGS;
+}
+
+/* Attribute SerialICE time to the functions of a firmware ELF file:
+ * SerialICE_load_symbols(<path>[, <stage>[, <offset>]])
+ * <offset> is added to the symbols of relocated stages.
+ */
+static int serialice_lua_load_symbols(lua_State * luastate)
+{
+    const char *path = luaL_checkstring(luastate, 1);
+    const char *stage = luaL_optstring(luastate, 2, NULL);
+    int64_t offset = luaL_optinteger(luastate, 3, 0);
+    int count;
+
+    count = serialice_load_symbols(path, stage, offset);
+    if (count < 0) {
+        return luaL_error(luastate, "Could not load symbols from %s", path);
+    }
+    printf("SerialICE: %d functions from %s\n", count, path);
+    return 0;
+}
+
+/* Keep the wire time profile per firmware function from the start:
+ * SerialICE_function_profile(<enable>)
+ */
+static int serialice_lua_function_profile(lua_State * luastate)
+{
+    serialice_function_profile = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Count target accesses per port and 4K page in time buckets:
+ * SerialICE_heatmap(<enable>[, <bucket_ms>])
+ */
+static int serialice_lua_heatmap(lua_State * luastate)
+{
+    int enable = lua_toboolean(luastate, 1);
+    lua_Integer bucket_ms = luaL_optinteger(luastate, 2, 0);
+
+    if (bucket_ms < 0 || bucket_ms > INT64_MAX / SCALE_MS) {
+        return luaL_error(luastate, "Invalid heatmap bucket width");
+    }
+    serialice_set_heatmap(enable, bucket_ms);
+    return 0;
+}
+
+/* Run a second board in lockstep, comparing every read:
+ * SerialICE_lockstep(<device>[, "first"|"second"[, <stop>]])
+ * The guest sees the reads of the named board, the first by default.
+ */
+static int serialice_lua_lockstep(lua_State * luastate)
+{
+    static const char *const use[] = { "first", "second", NULL };
+    const char *device = luaL_checkstring(luastate, 1);
+    int which = luaL_checkoption(luastate, 2, "first", use);
+
+    if (serialice_set_lockstep(device, which == 1 ?
+                               SERIALICE_LOCKSTEP_USE_SECOND :
+                               SERIALICE_LOCKSTEP_USE_FIRST,
+                               lua_toboolean(luastate, 3))) {
+        return luaL_error(luastate, "Lockstep can only be set up once, "
+                          "while the script is loaded");
+    }
+    return 0;
+}
+
+/* Tell SerialICE whether the target shell supports block transfers */
+static int serialice_lua_block_transfers(lua_State * luastate)
+{
+    serialice_block_transfers = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Tell SerialICE whether the target shell can send block reads
+ * compressed (*rz). Needs SerialICE_block_transfers.
+ */
+static int serialice_lua_compressed_transfers(lua_State * luastate)
+{
+    serialice_compressed_transfers = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Tell SerialICE whether the target shell understands framed commands
+ * (*F), which are sent again instead of ending the session when a reply
+ * is lost or garbled. Compressed block reads are not used then.
+ */
+static int serialice_lua_framed_transfers(lua_State * luastate)
+{
+    serialice_framed_transfers = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Stop guest time while waiting for the target, so delay loops and
+ * timeouts calibrated against local timers don't see wire time.
+ */
+static int serialice_lua_virtual_time(lua_State * luastate)
+{
+    serialice_virtual_time = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Keep a log of target writes since reset to be saved with snapshots */
+static int serialice_lua_record_writes(lua_State * luastate)
+{
+    serialice_record_writes = lua_toboolean(luastate, 1);
+    return 0;
+}
+
+/* Save a snapshot at a boot milestone: SerialICE_milestone(<name>) */
+static int serialice_lua_milestone(lua_State * luastate)
+{
+    const char *name = luaL_checkstring(luastate, 1);
+
+    if (!serialice_record_writes) {
+        return luaL_error(luastate, "Milestones need SerialICE_record_writes");
+    }
+    serialice_milestone(name);
     return 0;
 }
 
@@ -186,6 +824,190 @@ static int register_get(lua_State * L)
 
 #undef env
 
+// **************************************************************************
+// Compiled routes
+
+typedef struct {
+    uint64_t start, end;
+    int route;
+    int handler;
+} RouteRule;
+
+static int compare_bounds(const void *a, const void *b)
+{
+    uint64_t ba = *(const uint64_t *)a, bb = *(const uint64_t *)b;
+
+    return ba < bb ? -1 : ba > bb;
+}
+
+/* Flatten possibly overlapping rules, later ones taking precedence, into
+ * sorted segments that can be searched without calling into Lua.
+ */
+static void build_route_table(RouteTable *t, RouteRule *rules, int n)
+{
+    uint64_t *bounds = g_new(uint64_t, 2 * n + 1);
+    int i, j, nbounds = 0;
+
+    bounds[nbounds++] = 0;
+    for (i = 0; i < n; i++) {
+        bounds[nbounds++] = rules[i].start;
+        bounds[nbounds++] = rules[i].end + 1;
+    }
+    qsort(bounds, nbounds, sizeof(*bounds), compare_bounds);
+
+    t->bounds = g_new(uint64_t, nbounds);
+    t->routes = g_new(uint8_t, nbounds);
+    t->handlers = g_new(int, nbounds);
+    t->count = 0;
+
+    for (i = 0; i < nbounds; i++) {
+        int route = ROUTE_FILTER, handler = LUA_NOREF;
+
+        if (i > 0 && bounds[i] == bounds[i - 1]) {
+            continue;
+        }
+        for (j = 0; j < n; j++) {
+            if (rules[j].start <= bounds[i] && bounds[i] <= rules[j].end) {
+                route = rules[j].route;
+                handler = rules[j].handler;
+            }
+        }
+        if (t->count && t->routes[t->count - 1] == route &&
+            t->handlers[t->count - 1] == handler) {
+            continue;
+        }
+        t->bounds[t->count] = bounds[i];
+        t->routes[t->count] = route;
+        t->handlers[t->count] = handler;
+        t->count++;
+    }
+    g_free(bounds);
+}
+
+/* Compile SerialICE_routes[kind], a list of { first, last, route } entries
+ * where route is "qemu", "target", "both", "lua" or a function that is
+ * called instead of the global filter for this range.
+ */
+static void compile_routes(RouteTable *t, const char *kind)
+{
+    RouteRule *rules;
+    int i, n = 0;
+
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, kind);
+    } else {
+        lua_pushnil(L);
+    }
+    if (lua_istable(L, -1)) {
+        n = lua_rawlen(L, -1);
+    }
+    rules = g_new(RouteRule, n);
+
+    for (i = 0; i < n; i++) {
+        RouteRule *r = &rules[i];
+
+        lua_rawgeti(L, -1, i + 1);
+        if (!lua_istable(L, -1)) {
+            fprintf(stderr, "SerialICE_routes.%s[%d] is not a table\n",
+                    kind, i + 1);
+            exit(1);
+        }
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        lua_rawgeti(L, -3, 3);
+        r->start = lua_tointeger(L, -3);
+        r->end = lua_tointeger(L, -2);
+        r->handler = LUA_NOREF;
+        if (lua_isfunction(L, -1)) {
+            r->route = ROUTE_FILTER;
+            r->handler = luaL_ref(L, LUA_REGISTRYINDEX);
+            lua_pushnil(L);
+        } else if (lua_isstring(L, -1)) {
+            r->route = parse_route(lua_tostring(L, -1));
+        } else {
+            r->route = -1;
+        }
+        if (r->route < 0 || r->end < r->start) {
+            fprintf(stderr, "SerialICE_routes.%s[%d] is not a valid route\n",
+                    kind, i + 1);
+            exit(1);
+        }
+        lua_pop(L, 4);
+    }
+    lua_pop(L, 1);
+
+    build_route_table(t, rules, n);
+    g_free(rules);
+
+    if (n) {
+        printf("SerialICE: Compiled %d %s routes into %zu segments\n",
+               n, kind, t->count);
+    }
+}
+
+static void serialice_lua_compile_routes(void)
+{
+    size_t i;
+
+    lua_getglobal(L, "SerialICE_routes");
+    if (!lua_isnil(L, -1) && !lua_istable(L, -1)) {
+        fprintf(stderr, "SerialICE_routes is not a table\n");
+        exit(1);
+    }
+    compile_routes(&io_routes, "io");
+    compile_routes(&memory_routes, "memory");
+    lua_pop(L, 1);
+
+    /* Ports going to the filter are the default of the port route map.
+     * Leave them alone to keep routes the script body set on its own.
+     */
+    for (i = 0; i < io_routes.count && io_routes.bounds[i] <= 0xffff; i++) {
+        uint64_t last = 0xffff;
+
+        if (io_routes.routes[i] == ROUTE_FILTER) {
+            continue;
+        }
+        if (i + 1 < io_routes.count && io_routes.bounds[i + 1] <= 0x10000) {
+            last = io_routes.bounds[i + 1] - 1;
+        }
+        serialice_set_io_route(io_routes.bounds[i], last, io_routes.routes[i]);
+    }
+}
+
+static size_t route_index(const RouteTable *t, uint64_t addr)
+{
+    const uint64_t *base = t->bounds;
+    size_t n = t->count;
+
+    while (n > 1) {
+        size_t half = n / 2;
+
+        base = (base[half] <= addr) ? base + half : base;
+        n -= half;
+    }
+    return base - t->bounds;
+}
+
+/* Look up the compiled route of a memory access. Anything but
+ * ROUTE_FILTER is final and skips both the filter and the logger.
+ */
+static int compiled_route(const RouteTable *t, uint64_t addr, int *handler)
+{
+    size_t i = route_index(t, addr);
+
+    *handler = t->handlers[i];
+    skip_log = t->routes[i] != ROUTE_FILTER;
+    return t->routes[i];
+}
+
+/* Custom filter of a port. Fixed port routes live in the port route map
+ * of serialice.c, so these accesses never get here.
+ */
+static int io_route_handler(uint16_t port)
+{
+    return io_routes.handlers[route_index(&io_routes, port)];
+}
+
 static int serialice_lua_registers(void)
 {
     const struct luaL_Reg registermt[] = {
@@ -207,7 +1029,26 @@ static int serialice_lua_registers(void)
     return 0;
 }
 
-const SerialICE_filter * serialice_lua_init(const char *serialice_lua_script)
+/* Tell the script where QEMU put guest RAM, so it can keep accesses to
+ * it local: SerialICE_memory_layout.below_4g, .above_4g and
+ * .above_4g_start hold the sizes and the start of RAM above 4G.
+ */
+static void serialice_lua_memory_layout(void)
+{
+    X86MachineState *x86ms = X86_MACHINE(qdev_get_machine());
+
+    lua_newtable(L);
+    lua_pushinteger(L, x86ms->below_4g_mem_size);
+    lua_setfield(L, -2, "below_4g");
+    lua_pushinteger(L, x86ms->above_4g_mem_size);
+    lua_setfield(L, -2, "above_4g");
+    lua_pushinteger(L, x86ms->above_4g_mem_start);
+    lua_setfield(L, -2, "above_4g_start");
+    lua_setglobal(L, "SerialICE_memory_layout");
+}
+
+const SerialICE_filter * serialice_lua_init(const char *serialice_lua_script,
+                                            const char *mainboard)
 {
     int status;
 
@@ -216,25 +1057,73 @@ const SerialICE_filter * serialice_lua_init(const char *serialice_lua_script)
 
     printf("SerialICE: LUA init...\n");
 
+    reported_errors = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free, NULL);
+
     /* Create a LUA context and load LUA libraries */
     L = luaL_newstate();
     luaL_openlibs(L);
 
     /* Register C function callbacks */
-    lua_register(L, "SerialICE_register_physical", serialice_register_physical);
+    lua_register(L, "SerialICE_register_physical",
+                 serialice_lua_register_physical);
     lua_register(L, "SerialICE_system_reset", serialice_system_reset);
+    lua_register(L, "SerialICE_set_error_route", serialice_set_error_route);
+    lua_register(L, "SerialICE_set_io_route", serialice_lua_set_io_route);
+    lua_register(L, "SerialICE_wc_range", serialice_lua_wc_range);
+    lua_register(L, "SerialICE_readahead_range", serialice_lua_readahead_range);
+    lua_register(L, "SerialICE_debug_range", serialice_lua_debug_range);
+    lua_register(L, "SerialICE_constant_learning",
+                 serialice_lua_constant_learning);
+    lua_register(L, "SerialICE_constant_range", serialice_lua_constant_range);
+    lua_register(L, "SerialICE_load_symbols", serialice_lua_load_symbols);
+    lua_register(L, "SerialICE_function_profile",
+                 serialice_lua_function_profile);
+    lua_register(L, "SerialICE_heatmap", serialice_lua_heatmap);
+    lua_register(L, "SerialICE_block_transfers", serialice_lua_block_transfers);
+    lua_register(L, "SerialICE_compressed_transfers",
+                 serialice_lua_compressed_transfers);
+    lua_register(L, "SerialICE_framed_transfers",
+                 serialice_lua_framed_transfers);
+    lua_register(L, "SerialICE_pci_commands", serialice_lua_pci_commands);
+    lua_register(L, "SerialICE_pci_cache", serialice_lua_pci_cache);
+    lua_register(L, "SerialICE_pci_ecam", serialice_lua_pci_ecam);
+    lua_register(L, "SerialICE_target_macros", serialice_lua_target_macros);
+    lua_register(L, "SerialICE_macro", serialice_lua_macro);
+    lua_register(L, "SerialICE_macro_call", serialice_lua_macro_call);
+    lua_register(L, "SerialICE_virtual_time", serialice_lua_virtual_time);
+    lua_register(L, "SerialICE_lockstep", serialice_lua_lockstep);
+    lua_register(L, "SerialICE_record_writes", serialice_lua_record_writes);
+    lua_register(L, "SerialICE_milestone", serialice_lua_milestone);
 
     /* Set global variable SerialICE_mainboard */
-    lua_pushstring(L, serialice_mainboard);
+    lua_pushstring(L, mainboard);
     lua_setglobal(L, "SerialICE_mainboard");
 
     /* Set global variable SerialICE_rom_size */
     lua_pushinteger(L, serialice_rom_size);
     lua_setglobal(L, "SerialICE_rom_size");
 
+    /* Set global table SerialICE_memory_layout */
+    serialice_lua_memory_layout();
+
     /* Enable Register Access */
     serialice_lua_registers();
 
+#ifdef CONFIG_SERIALICE_LUAJIT
+    /* Make the transaction struct available to the script */
+    status = luaL_loadstring(L, ffi_setup);
+    if (status == 0) {
+        lua_pushlightuserdata(L, &tx);
+        status = lua_pcall(L, 1, 0, 0);
+    }
+    if (status) {
+        fprintf(stderr, "Couldn't set up LuaJIT FFI: %s\n",
+                lua_tostring(L, -1));
+        exit(1);
+    }
+#endif
+
     /* Load the script file */
     status = luaL_loadfile(L, serialice_lua_script);
     if (status) {
@@ -251,12 +1140,37 @@ const SerialICE_filter * serialice_lua_init(const char *serialice_lua_script)
     }
     lua_pop(L, 1);
 
+    serialice_lua_compile_routes();
+
+#ifdef CONFIG_SERIALICE_LUAJIT
+    /* Scripts opt into having hooks called without stack arguments */
+    lua_getglobal(L, "SerialICE_use_ffi");
+    use_ffi = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (use_ffi) {
+        printf("SerialICE: Passing transactions through LuaJIT FFI\n");
+    }
+#endif
+
     return &lua_ops;
 }
 
+static void free_route_table(RouteTable *t)
+{
+    g_free(t->bounds);
+    g_free(t->routes);
+    g_free(t->handlers);
+    memset(t, 0, sizeof(*t));
+}
+
 void serialice_lua_exit(void)
 {
     lua_close(L);
+    g_hash_table_destroy(reported_errors);
+    free_route_table(&io_routes);
+    free_route_table(&memory_routes);
+    error_route = ERROR_ROUTE_STOP;
+    use_ffi = false;
 }
 
 const char *serialice_lua_execute(const char *cmd)
@@ -273,19 +1187,239 @@ const char *serialice_lua_execute(const char *cmd)
     return errstring;
 }
 
+typedef struct {
+    const char *code;
+    SerialICELuaResult *result;
+    char *error;
+} LuaExecRequest;
+
+/* The string at @idx, or a description of @what if it isn't one */
+static char *lua_describe(int idx, const char *what)
+{
+    const char *s = lua_tostring(L, idx);
+
+    if (s) {
+        return g_strdup(s);
+    }
+    return g_strdup_printf("(%s is a %s value)", what,
+                           luaL_typename(L, idx));
+}
+
+static void lua_exec_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    LuaExecRequest *req = data.host_ptr;
+    int top = lua_gettop(L);
+    int i;
+
+    if (luaL_loadbuffer(L, req->code, strlen(req->code), "qmp")
+        || lua_pcall(L, 0, LUA_MULTRET, 0)) {
+        req->error = lua_describe(-1, "error object");
+        lua_settop(L, top);
+        return;
+    }
+
+    req->result = g_new0(SerialICELuaResult, 1);
+    for (i = lua_gettop(L); i > top; i--) {
+        lua_getglobal(L, "tostring");
+        lua_pushvalue(L, i);
+        /* __tostring metamethods may fail or return anything */
+        if (lua_pcall(L, 1, 1, 0)) {
+            req->error = lua_describe(-1, "error object");
+            qapi_free_SerialICELuaResult(req->result);
+            req->result = NULL;
+            break;
+        }
+        QAPI_LIST_PREPEND(req->result->results,
+                          lua_describe(-1, "tostring result"));
+        lua_pop(L, 1);
+    }
+    lua_settop(L, top);
+}
+
+SerialICELuaResult *qmp_serialice_lua_exec(const char *code, Error **errp)
+{
+    LuaExecRequest req = { .code = code };
+
+    if (!serialice_active) {
+        error_setg(errp, "SerialICE is not active");
+        return NULL;
+    }
+    if (replay_mode != REPLAY_MODE_NONE) {
+        error_setg(errp, "Target commands from the monitor can't be "
+                   "replayed");
+        return NULL;
+    }
+
+    /* Scripts may talk to the target, which belongs to the vCPU thread */
+    run_on_cpu(first_cpu, lua_exec_on_cpu, RUN_ON_CPU_HOST_PTR(&req));
+
+    if (req.error || !req.result) {
+        error_setg(errp, "%s", req.error ? req.error : "Lua failed");
+        g_free(req.error);
+        return NULL;
+    }
+    return req.result;
+}
+
+/* @return the length of the "chunk:line:" prefix Lua puts on runtime
+ * errors, or 0 if @msg has none
+ */
+static size_t error_site_len(const char *msg)
+{
+    const char *p, *q;
+
+    for (p = strchr(msg, ':'); p; p = strchr(p + 1, ':')) {
+        q = p + 1;
+        while (g_ascii_isdigit(*q)) {
+            q++;
+        }
+        if (q > p + 1 && *q == ':') {
+            return q - msg;
+        }
+    }
+    return 0;
+}
+
+/* Run a Lua hook whose function and arguments are already on the stack.
+ *
+ * Errors are reported once per hook and script location, counted in the
+ * SerialICE statistics and then handled according to the error route.
+ *
+ * @return 0: results are on the stack; -1: the hook failed.
+ */
+static int call_hook(int hook, int nargs, int nresults)
+{
+    const char *msg;
+    char *site;
+    int result;
+
+    trace_serialice_lua_enter(hook_names[hook]);
+    if (profiling) {
+        HookProfile *p = &hook_profile[hook];
+        int64_t start = get_clock(), elapsed;
+
+        result = lua_pcall(L, nargs, nresults, 0);
+
+        elapsed = get_clock() - start;
+        p->calls++;
+        p->total_ns += elapsed;
+        if (elapsed > p->max_ns) {
+            p->max_ns = elapsed;
+        }
+    } else {
+        result = lua_pcall(L, nargs, nresults, 0);
+    }
+    trace_serialice_lua_exit(hook_names[hook], result);
+
+    if (result == 0) {
+        return 0;
+    }
+
+    serialice_stats.lua_errors++;
+
+    /* The message may carry data that changes from call to call, so only
+     * its call site is kept.
+     */
+    msg = lua_tostring(L, -1);
+    if (!msg) {
+        msg = "(error object is not a string)";
+    }
+    site = g_strdup_printf("%s: %.*s", hook_names[hook],
+                           (int)error_site_len(msg), msg);
+    if (g_hash_table_add(reported_errors, site)) {
+        fprintf(stderr, "Failed to run function %s: %s\n", hook_names[hook],
+                msg);
+    }
+    lua_pop(L, 1);
+
+    if (error_route == ERROR_ROUTE_STOP && runstate_is_running()) {
+        fprintf(stderr, "SerialICE: Lua error, stopping VM.\n");
+        vm_stop(RUN_STATE_PAUSED);
+    }
+    return -1;
+}
+
+/* Route of an access whose filter failed. */
+static int hook_fallback(void)
+{
+    if (error_route == ERROR_ROUTE_QEMU) {
+        return READ_FROM_QEMU;
+    }
+    return READ_FROM_SERIALICE;
+}
+
+/* Push the filter for an access, either the global hook or the custom
+ * handler of its compiled route.
+ */
+static void push_filter(int hook, int handler)
+{
+    if (handler != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, handler);
+    } else {
+        lua_getglobal(L, hook_names[hook]);
+    }
+}
+
+/* Call a filter with the transaction in SerialICE_tx. */
+static int call_ffi_filter(int hook, int handler)
+{
+    push_filter(hook, handler);
+    tx.route = 0;
+    if (call_hook(hook, 0, 0)) {
+        return hook_fallback();
+    }
+    return tx.route;
+}
+
+/* Call a logger with the transaction in SerialICE_tx. */
+static void call_ffi_log(int hook)
+{
+    lua_getglobal(L, hook_names[hook]);
+    call_hook(hook, 0, 0);
+}
+
+/* @return the number of values pushed for @data */
+static int push_data(uint64_t data, int size)
+{
+    if (SPLIT_64BIT_DATA && size == 8) {
+        lua_pushinteger(L, (uint32_t)data);
+        lua_pushinteger(L, data >> 32);
+        return 2;
+    }
+    lua_pushinteger(L, data);
+    return 1;
+}
+
+/* Data returned by a hook at @idx, replacing @data */
+static uint64_t to_data(int idx, uint64_t data, int size)
+{
+    uint64_t hi = data >> 32;
+
+    if (SPLIT_64BIT_DATA && size == 8) {
+        if (!lua_isnil(L, idx + 1)) {
+            hi = (uint32_t)lua_tointeger(L, idx + 1);
+        }
+        return hi << 32 | (uint32_t)lua_tointeger(L, idx);
+    }
+    return lua_tointeger(L, idx);
+}
+
 static int io_read_pre(uint16_t port, int size)
 {
-    int ret = 0, result;
+    int ret = 0, handler = io_route_handler(port);
+
+    if (use_ffi) {
+        tx.addr = port;
+        tx.size = size;
+        return call_ffi_filter(HOOK_IO_READ_FILTER, handler);
+    }
 
-    lua_getglobal(L, "SerialICE_io_read_filter");
+    push_filter(HOOK_IO_READ_FILTER, handler);
     lua_pushinteger(L, port);   // port
     lua_pushinteger(L, size);   // datasize
 
-    result = lua_pcall(L, 2, 2, 0);
-    if (result) {
-        fprintf(stderr, "Failed to run function SerialICE_io_read_filter: %s\n",
-                lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_IO_READ_FILTER, 2, 2)) {
+        return hook_fallback();
     }
 
     ret |= lua_toboolean(L, -1) ? READ_FROM_QEMU : 0;
@@ -296,19 +1430,24 @@ static int io_read_pre(uint16_t port, int size)
 
 static int io_write_pre(uint64_t * data, uint16_t port, int size)
 {
-    int ret = 0, result;
+    int ret = 0, handler = io_route_handler(port);
+
+    if (use_ffi) {
+        tx.addr = port;
+        tx.size = size;
+        tx.data = *data;
+        ret = call_ffi_filter(HOOK_IO_WRITE_FILTER, handler);
+        *data = tx.data;
+        return ret;
+    }
 
-    lua_getglobal(L, "SerialICE_io_write_filter");
+    push_filter(HOOK_IO_WRITE_FILTER, handler);
     lua_pushinteger(L, port);   // port
     lua_pushinteger(L, size);   // datasize
     lua_pushinteger(L, *data);  // data
 
-    result = lua_pcall(L, 3, 3, 0);
-    if (result) {
-        fprintf(stderr,
-                "Failed to run function SerialICE_io_write_filter: %s\n",
-                lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_IO_WRITE_FILTER, 3, 3)) {
+        return hook_fallback();
     }
 
     *data = lua_tointeger(L, -1);
@@ -320,18 +1459,27 @@ static int io_write_pre(uint64_t * data, uint16_t port, int size)
 
 static int memory_read_pre(uint32_t addr, int size)
 {
-    int ret = 0, result;
+    int ret, handler;
+
+    memory_read_size = size;
+
+    ret = compiled_route(&memory_routes, addr, &handler);
+    if (ret != ROUTE_FILTER) {
+        return ret;
+    }
+
+    if (use_ffi) {
+        tx.addr = addr;
+        tx.size = size;
+        return call_ffi_filter(HOOK_MEMORY_READ_FILTER, handler);
+    }
 
-    lua_getglobal(L, "SerialICE_memory_read_filter");
+    push_filter(HOOK_MEMORY_READ_FILTER, handler);
     lua_pushinteger(L, addr);
     lua_pushinteger(L, size);
 
-    result = lua_pcall(L, 2, 2, 0);
-    if (result) {
-        fprintf(stderr,
-                "Failed to run function SerialICE_memory_read_filter: %s\n",
-                lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_MEMORY_READ_FILTER, 2, 2)) {
+        return hook_fallback();
     }
 
     ret |= lua_toboolean(L, -1) ? READ_FROM_QEMU : 0;
@@ -343,42 +1491,59 @@ static int memory_read_pre(uint32_t addr, int size)
 static int memory_write_pre(uint32_t addr, int size,
                                          uint64_t * data)
 {
-    int ret = 0, result;
+    int ret, handler, n;
+
+    ret = compiled_route(&memory_routes, addr, &handler);
+    if (ret != ROUTE_FILTER) {
+        return ret;
+    }
 
-    lua_getglobal(L, "SerialICE_memory_write_filter");
+    if (use_ffi) {
+        tx.addr = addr;
+        tx.size = size;
+        tx.data = *data;
+        ret = call_ffi_filter(HOOK_MEMORY_WRITE_FILTER, handler);
+        *data = tx.data;
+        return ret;
+    }
+
+    push_filter(HOOK_MEMORY_WRITE_FILTER, handler);
     lua_pushinteger(L, addr);   // address
     lua_pushinteger(L, size);   // datasize
-    lua_pushinteger(L, *data);  // data
+    n = push_data(*data, size); // data
 
-    result = lua_pcall(L, 3, 3, 0);
-    if (result) {
-        fprintf(stderr,
-                "Failed to run function SerialICE_memory_write_filter: %s\n",
-                lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_MEMORY_WRITE_FILTER, 2 + n, 2 + n)) {
+        return hook_fallback();
     }
 
-    *data = lua_tointeger(L, -1);
-    ret |= lua_toboolean(L, -2) ? WRITE_TO_QEMU : 0;
-    ret |= lua_toboolean(L, -3) ? WRITE_TO_SERIALICE : 0;
-    lua_pop(L, 3);
+    *data = to_data(-n, *data, size);
+    ret |= lua_toboolean(L, -1 - n) ? WRITE_TO_QEMU : 0;
+    ret |= lua_toboolean(L, -2 - n) ? WRITE_TO_SERIALICE : 0;
+    lua_pop(L, 2 + n);
     return ret;
 }
 
 static int wrmsr_pre(uint32_t addr, uint32_t * hi, uint32_t * lo)
 {
-    int ret = 0, result;
+    int ret = 0;
+
+    if (use_ffi) {
+        tx.addr = addr;
+        tx.size = 8;
+        tx.data = ((uint64_t)*hi << 32) | *lo;
+        ret = call_ffi_filter(HOOK_MSR_WRITE_FILTER, LUA_NOREF);
+        *hi = tx.data >> 32;
+        *lo = tx.data;
+        return ret;
+    }
 
-    lua_getglobal(L, "SerialICE_msr_write_filter");
+    lua_getglobal(L, hook_names[HOOK_MSR_WRITE_FILTER]);
     lua_pushinteger(L, addr);   // port
     lua_pushinteger(L, *hi);    // high
     lua_pushinteger(L, *lo);    // low
 
-    result = lua_pcall(L, 3, 4, 0);
-    if (result) {
-        fprintf(stderr,
-                "Failed to run function SerialICE_msr_write_filter: %s\n", lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_MSR_WRITE_FILTER, 3, 4)) {
+        return hook_fallback();
     }
 
     *lo = lua_tointeger(L, -1);
@@ -391,16 +1556,19 @@ static int wrmsr_pre(uint32_t addr, uint32_t * hi, uint32_t * lo)
 
 static int rdmsr_pre(uint32_t addr)
 {
-    int ret = 0, result;
+    int ret = 0;
+
+    if (use_ffi) {
+        tx.addr = addr;
+        tx.size = 8;
+        return call_ffi_filter(HOOK_MSR_READ_FILTER, LUA_NOREF);
+    }
 
-    lua_getglobal(L, "SerialICE_msr_read_filter");
+    lua_getglobal(L, hook_names[HOOK_MSR_READ_FILTER]);
     lua_pushinteger(L, addr);
 
-    result = lua_pcall(L, 1, 2, 0);
-    if (result) {
-        fprintf(stderr,
-                "Failed to run function SerialICE_msr_read_filter: %s\n", lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_MSR_READ_FILTER, 1, 2)) {
+        return hook_fallback();
     }
 
     ret |= lua_toboolean(L, -1) ? WRITE_TO_QEMU : 0;
@@ -411,18 +1579,21 @@ static int rdmsr_pre(uint32_t addr)
 
 static int cpuid_pre(uint32_t eax, uint32_t ecx)
 {
-    int ret = 0, result;
+    int ret = 0;
 
-    lua_getglobal(L, "SerialICE_cpuid_filter");
+    if (use_ffi) {
+        tx.addr = eax;
+        tx.data = ecx;
+        tx.size = 4;
+        return call_ffi_filter(HOOK_CPUID_FILTER, LUA_NOREF);
+    }
+
+    lua_getglobal(L, hook_names[HOOK_CPUID_FILTER]);
     lua_pushinteger(L, eax);    // eax before calling
     lua_pushinteger(L, ecx);    // ecx before calling
 
-    result = lua_pcall(L, 2, 2, 0);
-    if (result) {
-        fprintf(stderr,
-                "Failed to run function SerialICE_cpuid_filter: %s\n",
-                lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_CPUID_FILTER, 2, 2)) {
+        return hook_fallback();
     }
 
     ret |= lua_toboolean(L, -1) ? WRITE_TO_QEMU : 0;
@@ -433,56 +1604,65 @@ static int cpuid_pre(uint32_t eax, uint32_t ecx)
 
 /* SerialICE output loggers */
 
-static void __read_post(int flags, uint64_t *data)
+static void __read_post(int flags, uint64_t *data, int size)
 {
-    int result;
+    int hook, n;
 
     if (flags & LOG_MEMORY) {
-        lua_getglobal(L, "SerialICE_memory_read_log");
+        hook = HOOK_MEMORY_READ_LOG;
     } else if (flags & LOG_IO) {
-        lua_getglobal(L, "SerialICE_io_read_log");
+        hook = HOOK_IO_READ_LOG;
     } else {
         fprintf(stderr, "serialice_read_log: bad type\n");
         exit(1);
     }
 
-    lua_pushinteger(L, *data);
-    result = lua_pcall(L, 1, 1, 0);
-    if (result) {
-        fprintf(stderr, "Failed to run function SerialICE_%s_read_log: %s\n",
-                (flags & LOG_MEMORY) ? "memory" : "io", lua_tostring(L, -1));
-        exit(1);
+    if ((flags & LOG_MEMORY) && skip_log) {
+        return;
     }
-    *data = lua_tointeger(L, -1);
-    lua_pop(L, 1);
+
+    if (use_ffi) {
+        tx.data = *data;
+        call_ffi_log(hook);
+        *data = tx.data;
+        return;
+    }
+
+    lua_getglobal(L, hook_names[hook]);
+    n = push_data(*data, size);
+    if (call_hook(hook, n, n)) {
+        return;
+    }
+    *data = to_data(-n, *data, size);
+    lua_pop(L, n);
 }
 
 static void __write_post(int flags)
 {
-    int result;
+    int hook;
 
     if (flags & LOG_MEMORY) {
-        lua_getglobal(L, "SerialICE_memory_write_log");
+        hook = HOOK_MEMORY_WRITE_LOG;
     } else if (flags & LOG_IO) {
-        lua_getglobal(L, "SerialICE_io_write_log");
+        hook = HOOK_IO_WRITE_LOG;
     } else if (flags & LOG_MSR) {
-        lua_getglobal(L, "SerialICE_msr_write_log");
+        hook = HOOK_MSR_WRITE_LOG;
     } else {
         fprintf(stderr, "serialice_write_log: bad type\n");
         exit(1);
     }
 
-    result = lua_pcall(L, 0, 0, 0);
-    if (result) {
-        fprintf(stderr, "Failed to run function SerialICE_%s_write_log: %s\n",
-                (flags & LOG_MEMORY) ? "memory" : "io", lua_tostring(L, -1));
-        exit(1);
+    if ((flags & LOG_MEMORY) && skip_log) {
+        return;
     }
+
+    lua_getglobal(L, hook_names[hook]);
+    call_hook(hook, 0, 0);
 }
 
 static void memory_read_post(uint64_t * data)
 {
-    __read_post(LOG_MEMORY, data);
+    __read_post(LOG_MEMORY, data, memory_read_size);
 }
 
 static void memory_write_post(void)
@@ -492,7 +1672,7 @@ static void memory_write_post(void)
 
 static void io_read_post(uint64_t * data)
 {
-    __read_post(LOG_IO, data);
+    __read_post(LOG_IO, data, 4);
 }
 
 static void io_write_post(void)
@@ -507,17 +1687,20 @@ static void wrmsr_post(void)
 
 static void rdmsr_post(uint32_t *hi, uint32_t *lo)
 {
-    int result;
+    if (use_ffi) {
+        tx.data = ((uint64_t)*hi << 32) | *lo;
+        call_ffi_log(HOOK_MSR_READ_LOG);
+        *hi = tx.data >> 32;
+        *lo = tx.data;
+        return;
+    }
 
-    lua_getglobal(L, "SerialICE_msr_read_log");
+    lua_getglobal(L, hook_names[HOOK_MSR_READ_LOG]);
     lua_pushinteger(L, *hi);
     lua_pushinteger(L, *lo);
 
-    result = lua_pcall(L, 2, 2, 0);
-    if (result) {
-        fprintf(stderr, "Failed to run function SerialICE_msr_read_log: %s\n",
-			lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_MSR_READ_LOG, 2, 2)) {
+        return;
     }
     *hi = lua_tointeger(L, -2);
     *lo = lua_tointeger(L, -1);
@@ -526,19 +1709,27 @@ static void rdmsr_post(uint32_t *hi, uint32_t *lo)
 
 static void cpuid_post(cpuid_regs_t * res)
 {
-    int result;
+    if (use_ffi) {
+        tx.regs[0] = res->eax;
+        tx.regs[1] = res->ebx;
+        tx.regs[2] = res->ecx;
+        tx.regs[3] = res->edx;
+        call_ffi_log(HOOK_CPUID_LOG);
+        res->eax = tx.regs[0];
+        res->ebx = tx.regs[1];
+        res->ecx = tx.regs[2];
+        res->edx = tx.regs[3];
+        return;
+    }
 
-    lua_getglobal(L, "SerialICE_cpuid_log");
+    lua_getglobal(L, hook_names[HOOK_CPUID_LOG]);
     lua_pushinteger(L, res->eax);        // output: eax
     lua_pushinteger(L, res->ebx);        // output: ebx
     lua_pushinteger(L, res->ecx);        // output: ecx
     lua_pushinteger(L, res->edx);        // output: edx
 
-    result = lua_pcall(L, 4, 4, 0);
-    if (result) {
-        fprintf(stderr, "Failed to run function SerialICE_cpuid_log: %s\n",
-                lua_tostring(L, -1));
-        exit(1);
+    if (call_hook(HOOK_CPUID_LOG, 4, 4)) {
+        return;
     }
     res->edx = lua_tointeger(L, -1);
     res->ecx = lua_tointeger(L, -2);
@@ -547,6 +1738,162 @@ static void cpuid_post(cpuid_regs_t * res)
     lua_pop(L, 4);
 }
 
+// **************************************************************************
+// Hook profiling
+
+/* Count hook: attributes every sample_count VM instructions to the
+ * script line being executed. LuaJIT only calls it for interpreted code.
+ */
+static void profile_sample(lua_State * luastate, lua_Debug * ar)
+{
+    char *line;
+    gpointer count;
+
+    if (!lua_getinfo(luastate, "Sl", ar) || ar->currentline < 0) {
+        return;
+    }
+
+    line = g_strdup_printf("%s:%d", ar->short_src, ar->currentline);
+    count = g_hash_table_lookup(line_samples, line);
+    g_hash_table_replace(line_samples, line,
+                         GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+}
+
+static void profile_reset(void)
+{
+    memset(hook_profile, 0, sizeof(hook_profile));
+    if (line_samples) {
+        g_hash_table_remove_all(line_samples);
+    }
+}
+
+static void profile_start(int count)
+{
+    if (!line_samples) {
+        line_samples = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    }
+
+    sample_count = count;
+    if (sample_count > 0) {
+        lua_sethook(L, profile_sample, LUA_MASKCOUNT, sample_count);
+    } else {
+        lua_sethook(L, NULL, 0, 0);
+    }
+    profiling = true;
+}
+
+static void profile_stop(void)
+{
+    lua_sethook(L, NULL, 0, 0);
+    profiling = false;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    guint sa = GPOINTER_TO_UINT(g_hash_table_lookup(line_samples,
+                                                    *(char *const *)a));
+    guint sb = GPOINTER_TO_UINT(g_hash_table_lookup(line_samples,
+                                                    *(char *const *)b));
+
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/* The Lua state and the samples its count hook takes belong to the vCPU
+ * thread, so the monitor commands are run there.
+ */
+static void profile_start_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    profile_start(data.host_int);
+}
+
+static void profile_stop_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    profile_stop();
+}
+
+static void profile_reset_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    profile_reset();
+}
+
+void hmp_serialice_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_str(qdict, "op");
+    int count = qdict_get_try_int(qdict, "count", 1000);
+
+    if (!serialice_active) {
+        monitor_printf(mon, "SerialICE is not active.\n");
+        return;
+    }
+
+    if (strcmp(op, "on") == 0) {
+        run_on_cpu(first_cpu, profile_start_on_cpu,
+                   RUN_ON_CPU_HOST_INT(count));
+    } else if (strcmp(op, "off") == 0) {
+        run_on_cpu(first_cpu, profile_stop_on_cpu, RUN_ON_CPU_NULL);
+    } else if (strcmp(op, "reset") == 0) {
+        run_on_cpu(first_cpu, profile_reset_on_cpu, RUN_ON_CPU_NULL);
+    } else {
+        monitor_printf(mon, "Unexpected argument '%s'\n", op);
+    }
+}
+
+static void profile_report_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    GString *out = data.host_ptr;
+    guint i, len;
+    gpointer *lines;
+
+    g_string_append_printf(out, "Profiling is %s\n",
+                           profiling ? "on" : "off");
+    g_string_append_printf(out, "%-32s %10s %12s %10s %10s\n",
+                           "hook", "calls", "total (ms)", "avg (us)",
+                           "max (us)");
+    for (i = 0; i < NUM_HOOKS; i++) {
+        HookProfile *p = &hook_profile[i];
+
+        if (!p->calls) {
+            continue;
+        }
+        g_string_append_printf(out, "%-32s %10" PRIu64 " %12.3f %10.3f "
+                               "%10.3f\n", hook_names[i], p->calls,
+                               p->total_ns / 1e6,
+                               p->total_ns / 1e3 / p->calls,
+                               p->max_ns / 1e3);
+    }
+
+    if (!line_samples || !g_hash_table_size(line_samples)) {
+        return;
+    }
+
+    g_string_append_printf(out, "\nSamples every %d instructions:\n",
+                           sample_count);
+    lines = g_hash_table_get_keys_as_array(line_samples, &len);
+    qsort(lines, len, sizeof(gpointer), compare_samples);
+    for (i = 0; i < len && i < 20; i++) {
+        g_string_append_printf(out, "%10u  %s\n",
+                               GPOINTER_TO_UINT(g_hash_table_lookup(
+                                   line_samples, lines[i])),
+                               (char *)lines[i]);
+    }
+    g_free(lines);
+}
+
+void hmp_info_serialice_profile(Monitor *mon, const QDict *qdict)
+{
+    g_autoptr(GString) out = NULL;
+
+    if (!serialice_active) {
+        monitor_printf(mon, "SerialICE is not active.\n");
+        return;
+    }
+
+    out = g_string_new(NULL);
+    run_on_cpu(first_cpu, profile_report_on_cpu, RUN_ON_CPU_HOST_PTR(out));
+    monitor_puts(mon, out->str);
+}
+
 static const SerialICE_filter lua_ops = {
     .io_read_pre = io_read_pre,
     .io_read_post = io_read_post,
@@ -0,0 +1,460 @@
+/*
+ * SerialICE wire time profile per firmware function
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* System includes */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Local includes */
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qdict.h"
+#include "monitor/monitor.h"
+#include "hw/core/cpu.h"
+#include "elf.h"
+#include "serialice.h"
+
+int serialice_function_profile = 0;
+
+/* A firmware function and the SerialICE time spent on its behalf */
+typedef struct {
+    uint64_t start, end;
+    const char *name;
+    const char *stage;
+    uint64_t transactions;
+    int64_t wire_ns;
+    int64_t host_ns;            // Lua filters and SerialICE itself
+} SerialICE_symbol;
+
+static GArray *symbols;         // sorted by start, not overlapping
+static GStringChunk *names;
+static SerialICE_symbol unknown = { .name = "[unknown]", .stage = "" };
+static SerialICE_symbol *last_hit;
+
+// **************************************************************************
+// ELF symbol tables
+
+typedef struct {
+    uint32_t type, link;
+    uint64_t offset, size, entsize;
+} ElfSection;
+
+static bool elf_section(const uint8_t *img, gsize len, bool is64,
+                        uint64_t shoff, unsigned int shentsize,
+                        unsigned int i, ElfSection *sec)
+{
+    uint64_t off = shoff + (uint64_t)i * shentsize;
+
+    if (shoff > len || off > len ||
+        len - off < (is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr)))
+        return false;
+
+    if (is64) {
+        const Elf64_Shdr *sh = (const Elf64_Shdr *)(img + off);
+
+        sec->type = sh->sh_type;
+        sec->link = sh->sh_link;
+        sec->offset = sh->sh_offset;
+        sec->size = sh->sh_size;
+        sec->entsize = sh->sh_entsize;
+    } else {
+        const Elf32_Shdr *sh = (const Elf32_Shdr *)(img + off);
+
+        sec->type = sh->sh_type;
+        sec->link = sh->sh_link;
+        sec->offset = sh->sh_offset;
+        sec->size = sh->sh_size;
+        sec->entsize = sh->sh_entsize;
+    }
+    return sec->offset <= len && sec->size <= len - sec->offset;
+}
+
+static int symbols_from_symtab(const uint8_t *img, bool is64,
+                               const ElfSection *symtab,
+                               const ElfSection *strtab, const char *stage,
+                               int64_t offset)
+{
+    unsigned int symsize = is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+    const char *str = (const char *)img + strtab->offset;
+    SerialICE_symbol sym = { .stage = stage };
+    uint64_t i, value, size;
+    uint32_t name;
+    int type, count = 0;
+
+    if (symtab->entsize < symsize)
+        return 0;
+
+    for (i = 0; i + symtab->entsize <= symtab->size; i += symtab->entsize) {
+        const uint8_t *p = img + symtab->offset + i;
+
+        if (is64) {
+            const Elf64_Sym *s = (const Elf64_Sym *)p;
+
+            name = s->st_name;
+            type = ELF64_ST_TYPE(s->st_info);
+            value = s->st_value;
+            size = s->st_size;
+            if (s->st_shndx == SHN_UNDEF)
+                continue;
+        } else {
+            const Elf32_Sym *s = (const Elf32_Sym *)p;
+
+            name = s->st_name;
+            type = ELF32_ST_TYPE(s->st_info);
+            value = s->st_value;
+            size = s->st_size;
+            if (s->st_shndx == SHN_UNDEF)
+                continue;
+        }
+
+        if (type != STT_FUNC || !name || name >= strtab->size ||
+            !memchr(str + name, '\0', strtab->size - name))
+            continue;
+
+        sym.start = value + offset;
+        sym.end = sym.start + size;
+        sym.name = g_string_chunk_insert_const(names, str + name);
+        g_array_append_val(symbols, sym);
+        count++;
+    }
+    return count;
+}
+
+static int compare_symbols(gconstpointer a, gconstpointer b)
+{
+    const SerialICE_symbol *sa = a, *sb = b;
+
+    return sa->start < sb->start ? -1 : sa->start > sb->start;
+}
+
+/* Sort the table and make functions end where the next one begins if
+ * they overlap or have no size.
+ */
+static void symbols_sort(void)
+{
+    SerialICE_symbol *s;
+    guint i, n = 0;
+
+    g_array_sort(symbols, compare_symbols);
+    s = &g_array_index(symbols, SerialICE_symbol, 0);
+    for (i = 0; i < symbols->len; i++) {
+        /* aliases: keep the first name */
+        if (n && s[i].start == s[n - 1].start)
+            continue;
+        s[n++] = s[i];
+    }
+    g_array_set_size(symbols, n);
+
+    s = &g_array_index(symbols, SerialICE_symbol, 0);
+    for (i = 0; i + 1 < n; i++) {
+        if (s[i].end <= s[i].start || s[i].end > s[i + 1].start)
+            s[i].end = s[i + 1].start;
+    }
+    if (n && s[n - 1].end <= s[n - 1].start)
+        s[n - 1].end = s[n - 1].start + 1;
+    last_hit = NULL;
+}
+
+/* Forget all symbols loaded so far */
+static void symbols_unload(void)
+{
+    if (!symbols)
+        return;
+
+    g_array_free(symbols, TRUE);
+    g_string_chunk_free(names);
+    symbols = NULL;
+    names = NULL;
+    last_hit = NULL;
+}
+
+/* Add the functions of the ELF file @path, relocated by @offset. They
+ * show up under @stage, or the file name up to the first dot.
+ *
+ * @return the number of functions or -1 if the file isn't usable
+ */
+int serialice_load_symbols(const char *path, const char *stage,
+                           int64_t offset)
+{
+    g_autofree uint8_t *img = NULL;
+    g_autofree char *base = NULL;
+    g_autoptr(GError) err = NULL;
+    ElfSection symtab, strtab;
+    unsigned int shnum, shentsize, i;
+    uint64_t shoff;
+    gsize len;
+    bool is64;
+    int count = 0;
+
+    if (!g_file_get_contents(path, (gchar **)&img, &len, &err)) {
+        error_report("SerialICE: %s", err->message);
+        return -1;
+    }
+
+    is64 = len >= EI_NIDENT && img[EI_CLASS] == ELFCLASS64;
+    if (len < (is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr)) ||
+        memcmp(img, ELFMAG, SELFMAG) || img[EI_DATA] != ELFDATA2LSB) {
+        error_report("SerialICE: %s is not a little endian ELF file", path);
+        return -1;
+    }
+
+    if (is64) {
+        const Elf64_Ehdr *eh = (const Elf64_Ehdr *)img;
+
+        shoff = eh->e_shoff;
+        shnum = eh->e_shnum;
+        shentsize = eh->e_shentsize;
+    } else {
+        const Elf32_Ehdr *eh = (const Elf32_Ehdr *)img;
+
+        shoff = eh->e_shoff;
+        shnum = eh->e_shnum;
+        shentsize = eh->e_shentsize;
+    }
+
+    if (!stage) {
+        base = g_path_get_basename(path);
+        base[strcspn(base, ".")] = '\0';
+        stage = base;
+    }
+
+    if (!symbols) {
+        symbols = g_array_new(FALSE, FALSE, sizeof(SerialICE_symbol));
+        names = g_string_chunk_new(4096);
+    }
+    stage = g_string_chunk_insert_const(names, stage);
+
+    for (i = 0; i < shnum; i++) {
+        if (!elf_section(img, len, is64, shoff, shentsize, i, &symtab) ||
+            symtab.type != SHT_SYMTAB)
+            continue;
+        if (!elf_section(img, len, is64, shoff, shentsize, symtab.link,
+                         &strtab))
+            continue;
+        count += symbols_from_symtab(img, is64, &symtab, &strtab, stage,
+                                     offset);
+    }
+
+    symbols_sort();
+    return count;
+}
+
+// **************************************************************************
+// attribution
+
+static SerialICE_symbol *symbol_lookup(uint64_t pc)
+{
+    SerialICE_symbol *s;
+    guint lo = 0, hi;
+
+    /* polling loops keep hitting the same function */
+    if (last_hit && pc - last_hit->start < last_hit->end - last_hit->start)
+        return last_hit;
+
+    if (!symbols || !symbols->len)
+        return &unknown;
+
+    s = &g_array_index(symbols, SerialICE_symbol, 0);
+    hi = symbols->len;
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (pc < s[mid].start) {
+            hi = mid;
+        } else if (pc >= s[mid].end) {
+            lo = mid + 1;
+        } else {
+            last_hit = &s[mid];
+            return last_hit;
+        }
+    }
+    return &unknown;
+}
+
+/* Account a transaction issued by the guest code at @pc */
+void serialice_profile_transaction(uint64_t pc, int64_t wire_ns,
+                                   int64_t total_ns)
+{
+    SerialICE_symbol *s = symbol_lookup(pc);
+
+    s->transactions++;
+    s->wire_ns += wire_ns;
+    s->host_ns += total_ns - wire_ns;
+}
+
+static void profile_reset(void)
+{
+    guint i;
+
+    for (i = 0; symbols && i < symbols->len; i++) {
+        SerialICE_symbol *s = &g_array_index(symbols, SerialICE_symbol, i);
+
+        s->transactions = s->wire_ns = s->host_ns = 0;
+    }
+    unknown.transactions = unknown.wire_ns = unknown.host_ns = 0;
+}
+
+void serialice_profile_script_reset(void)
+{
+    serialice_function_profile = 0;
+    symbols_unload();
+    profile_reset();
+}
+
+static void profile_save_symbol(FILE *f, const SerialICE_symbol *s)
+{
+    const char *sep = *s->stage ? ";" : "";
+
+    if (s->wire_ns / SCALE_US)
+        fprintf(f, "%s%s%s;[wire] %" PRId64 "\n", s->stage, sep, s->name,
+                s->wire_ns / SCALE_US);
+    if (s->host_ns / SCALE_US)
+        fprintf(f, "%s%s%s;[host] %" PRId64 "\n", s->stage, sep, s->name,
+                s->host_ns / SCALE_US);
+}
+
+// **************************************************************************
+// monitor interface
+
+/* Scripts may load symbols from a hook, which sorts and grows the table
+ * on the vCPU thread, so the monitor works on copies made there.
+ */
+typedef struct {
+    SerialICE_symbol *s;        // functions with transactions
+    guint n;
+    guint known;                // functions in the table
+} SerialICE_symbol_copy;
+
+static void profile_copy_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    SerialICE_symbol_copy *c = data.host_ptr;
+    guint i, len = symbols ? symbols->len : 0;
+
+    c->s = g_new(SerialICE_symbol, len + 1);
+    c->n = 0;
+    c->known = len;
+    for (i = 0; i < len; i++) {
+        SerialICE_symbol *s = &g_array_index(symbols, SerialICE_symbol, i);
+
+        if (s->transactions)
+            c->s[c->n++] = *s;
+    }
+    if (unknown.transactions)
+        c->s[c->n++] = unknown;
+}
+
+static void profile_copy(SerialICE_symbol_copy *c)
+{
+    run_on_cpu(first_cpu, profile_copy_on_cpu, RUN_ON_CPU_HOST_PTR(c));
+}
+
+static void profile_reset_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    profile_reset();
+}
+
+/* Write the profile as folded stacks for flamegraph.pl and compatible
+ * tools, in microseconds: stage;function;[wire] and stage;function;[host]
+ */
+static int profile_save(const char *path)
+{
+    SerialICE_symbol_copy c;
+    FILE *f = fopen(path, "w");
+    guint i;
+
+    if (!f)
+        return -1;
+
+    profile_copy(&c);
+    for (i = 0; i < c.n; i++)
+        profile_save_symbol(f, &c.s[i]);
+    g_free(c.s);
+    return fclose(f);
+}
+
+void hmp_serialice_function_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_str(qdict, "op");
+    const char *file = qdict_get_try_str(qdict, "file");
+
+    if (!serialice_active) {
+        monitor_printf(mon, "SerialICE is not active.\n");
+        return;
+    }
+
+    if (strcmp(op, "on") == 0) {
+        serialice_function_profile = 1;
+    } else if (strcmp(op, "off") == 0) {
+        serialice_function_profile = 0;
+    } else if (strcmp(op, "reset") == 0) {
+        run_on_cpu(first_cpu, profile_reset_on_cpu, RUN_ON_CPU_NULL);
+    } else if (strcmp(op, "save") == 0) {
+        if (!file) {
+            monitor_printf(mon, "Missing file name\n");
+        } else if (profile_save(file)) {
+            monitor_printf(mon, "Could not write %s: %s\n", file,
+                           strerror(errno));
+        }
+    } else {
+        monitor_printf(mon, "Unexpected argument '%s'\n", op);
+    }
+}
+
+static int compare_cost(const void *a, const void *b)
+{
+    const SerialICE_symbol *sa = a;
+    const SerialICE_symbol *sb = b;
+    int64_t ca = sa->wire_ns + sa->host_ns, cb = sb->wire_ns + sb->host_ns;
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+void hmp_info_serialice_functions(Monitor *mon, const QDict *qdict)
+{
+    SerialICE_symbol_copy c;
+    guint i;
+
+    if (!serialice_active) {
+        monitor_printf(mon, "SerialICE is not active.\n");
+        return;
+    }
+
+    profile_copy(&c);
+    monitor_printf(mon, "Function profile is %s, %u functions known\n",
+                   serialice_function_profile ? "on" : "off", c.known);
+
+    qsort(c.s, c.n, sizeof(*c.s), compare_cost);
+
+    monitor_printf(mon, "%-40s %-10s %12s %10s %10s\n", "function", "stage",
+                   "transactions", "wire (ms)", "host (ms)");
+    for (i = 0; i < c.n && i < 20; i++) {
+        SerialICE_symbol *s = &c.s[i];
+
+        monitor_printf(mon, "%-40s %-10s %12" PRIu64 " %10.3f %10.3f\n",
+                       s->name, s->stage, s->transactions, s->wire_ns / 1e6,
+                       s->host_ns / 1e6);
+    }
+    g_free(c.s);
+}
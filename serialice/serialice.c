@@ -39,7 +39,11 @@
 #include "qemu/units.h"
 #include "qemu/main-loop.h"
 #include "qemu/datadir.h"
+#include "qemu/timer.h"
+#include "qemu/thread.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-serialice-target.h"
+#include "qapi/qapi-events-serialice-target.h"
 #include "migration/vmstate.h"
 #include "hw/qdev-properties.h"
 #include "hw/qdev-properties-system.h"
@@ -47,12 +51,22 @@
 #include "hw/hyperv/vmbus.h"
 #include "hw/hyperv/vmbus-bridge.h"
 #include "hw/i386/pc.h"
+#include "hw/pci/pci.h"
 #include "hw/sysbus.h"
 #include "hw/loader.h"
+#include "sysemu/hostmem.h"
 #include "cpu.h"
+#include "sysemu/runstate.h"
+#include "sysemu/reset.h"
+#include "sysemu/replay.h"
+#include "migration/snapshot.h"
+#include "block/aio.h"
 #include "exec/ioport.h"
 #include "ui/console.h"
+#include "monitor/monitor.h"
+#include "qemu/plugin.h"
 #include "serialice.h"
+#include "trace.h"
 
 #define SERIALICE_LUA_SCRIPT "serialice.lua"
 
@@ -65,6 +79,1805 @@ const SerialICE_filter *s_filter;
 int serialice_active = 0;
 int serialice_rom_size = -1;
 
+SerialICE_stats serialice_stats;
+
+uint8_t serialice_io_routes[65536 / 4];
+
+// **************************************************************************
+// script declared target memory ranges
+
+#define MAX_RANGES		16
+
+typedef struct {
+    uint32_t base, size;
+} SerialICE_range;
+
+typedef struct {
+    SerialICE_range range[MAX_RANGES];
+    int count;
+} SerialICE_ranges;
+
+static int add_range(SerialICE_ranges *r, uint32_t base, uint32_t size)
+{
+    if (r->count == MAX_RANGES)
+        return -1;
+
+    r->range[r->count].base = base;
+    r->range[r->count].size = size;
+    r->count++;
+    return 0;
+}
+
+/* @return the range containing all of [addr, addr + size) or NULL */
+static const SerialICE_range *find_range(const SerialICE_ranges *r,
+                                         uint32_t addr, unsigned int size)
+{
+    int i;
+
+    for (i = 0; i < r->count; i++) {
+        if (addr - r->range[i].base < r->range[i].size &&
+            addr + size - r->range[i].base <= r->range[i].size)
+            return &r->range[i];
+    }
+    return NULL;
+}
+
+// **************************************************************************
+// write combining of sequential stores to the target
+
+#define WC_BUFFER_SIZE		256
+#define WC_MAX_AGE_NS		(10 * SCALE_MS)
+
+static SerialICE_ranges wc_ranges;
+
+static struct {
+    uint32_t start;
+    unsigned int len;
+    int64_t opened;
+    uint8_t data[WC_BUFFER_SIZE];
+} wc;
+
+/* Sends out stores the guest doesn't follow with another transaction */
+static QEMUTimer *wc_timer;
+
+int serialice_add_wc_range(uint32_t base, uint32_t size)
+{
+    return add_range(&wc_ranges, base, size);
+}
+
+static void wc_script_reset(void)
+{
+    wc_ranges.count = 0;
+}
+
+/* 0xcf8 value written by the guest but not sent to the target yet.
+ * It is always older than the combined stores.
+ */
+static struct {
+    uint32_t address;
+    bool pending;
+} pci;
+
+static void pci_flush(void);
+
+/* Send out combined stores and a held back PCI configuration address.
+ * Must be called before any other transaction so the target sees
+ * accesses in program order.
+ */
+void serialice_flush(void)
+{
+    pci_flush();
+    if (!wc.len)
+        return;
+
+    trace_serialice_wc_flush(wc.start, wc.len);
+    s_target->store_block(wc.start, wc.data, wc.len);
+    serialice_stats.wc_flushes++;
+    wc.len = 0;
+}
+
+static void wc_store(uint32_t addr, unsigned int size, uint64_t data)
+{
+    /* under record/replay, flush points must not depend on host time */
+    int64_t now = replay_mode == REPLAY_MODE_NONE ? get_clock() :
+        qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    /* only ascending, contiguous stores are merged */
+    if (wc.len && (addr != wc.start + wc.len ||
+                   wc.len + size > WC_BUFFER_SIZE ||
+                   now - wc.opened > WC_MAX_AGE_NS))
+        serialice_flush();
+
+    if (!wc.len) {
+        wc.start = addr;
+        wc.opened = now;
+        if (wc_timer)
+            timer_mod(wc_timer, now + WC_MAX_AGE_NS);
+    }
+    stn_le_p(wc.data + wc.len, size, data);
+    wc.len += size;
+    serialice_stats.wc_stores++;
+    trace_serialice_wc_store(addr, size, wc.len);
+}
+
+static void wc_flush_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    /* the stores may have gone out and new ones come in meanwhile */
+    if (wc.len && get_clock() - wc.opened >= WC_MAX_AGE_NS)
+        serialice_flush();
+}
+
+/* The transport belongs to the vCPU thread */
+static void wc_timer_expired(void *opaque)
+{
+    async_run_on_cpu(first_cpu, wc_flush_on_cpu, RUN_ON_CPU_NULL);
+}
+
+/* Record and replay need target commands at reproducible instructions,
+ * which neither the timer nor a VM stop is. The stores go out with the
+ * next access instead.
+ */
+static void wc_vm_state_change(void *opaque, bool running, RunState state)
+{
+    if (!running && replay_mode == REPLAY_MODE_NONE)
+        serialice_flush();
+}
+
+// **************************************************************************
+// read-ahead from side-effect free target ranges
+
+#define RA_LINE_SIZE		64
+#define RA_WINDOW_SIZE		256
+#define RA_MAX_CPUS		8
+
+static SerialICE_ranges ra_ranges;
+
+/* Per vCPU stride detector and the window it fetched last */
+typedef struct {
+    uint32_t last_addr;
+    int32_t stride;
+    int confidence;
+    uint32_t start;
+    unsigned int len;
+    uint8_t data[RA_WINDOW_SIZE];
+} SerialICE_readahead;
+
+static SerialICE_readahead ra[RA_MAX_CPUS];
+
+int serialice_add_ra_range(uint32_t base, uint32_t size)
+{
+    return add_range(&ra_ranges, base, size);
+}
+
+static void ra_script_reset(void)
+{
+    ra_ranges.count = 0;
+}
+
+static void ra_invalidate(uint32_t addr, unsigned int size)
+{
+    int i;
+
+    for (i = 0; i < RA_MAX_CPUS; i++) {
+        if (addr < ra[i].start + ra[i].len && ra[i].start < addr + size)
+            ra[i].len = 0;
+    }
+}
+
+/* Load from a read-ahead range, fetching a line around the access or, once
+ * a constant stride has been seen, a whole window ahead of it.
+ */
+static uint64_t ra_load(const SerialICE_range *range, uint32_t addr,
+                        unsigned int size)
+{
+    SerialICE_readahead *r = &ra[current_cpu ?
+                                 current_cpu->cpu_index % RA_MAX_CPUS : 0];
+    int32_t stride = addr - r->last_addr;
+    uint64_t end = (uint64_t)range->base + range->size;
+    uint32_t start;
+
+    if (addr - r->start < r->len && addr + size - r->start <= r->len) {
+        serialice_stats.ra_hits++;
+        trace_serialice_ra_hit(addr, size);
+        r->last_addr = addr;
+        return ldn_le_p(r->data + addr - r->start, size);
+    }
+
+    if (stride == r->stride && stride > 0 && stride <= RA_WINDOW_SIZE / 4) {
+        r->confidence++;
+    } else {
+        r->confidence = 0;
+    }
+    r->stride = stride;
+    r->last_addr = addr;
+
+    if (r->confidence) {
+        start = addr;
+        r->len = MIN(RA_WINDOW_SIZE, end - start);
+    } else {
+        start = MAX(addr & ~(RA_LINE_SIZE - 1), range->base);
+        r->len = MIN(RA_LINE_SIZE, end - start);
+    }
+    if (addr + size - start > r->len) {
+        /* access straddles the end of the line */
+        r->len = 0;
+        return s_target->load(addr, size);
+    }
+
+    r->start = start;
+    trace_serialice_ra_fetch(r->start, r->len, r->confidence);
+    s_target->load_block(r->start, r->data, r->len);
+    serialice_stats.ra_fetches++;
+    return ldn_le_p(r->data + addr - r->start, size);
+}
+
+// **************************************************************************
+// learning cache for target registers that always read the same value
+
+#define CONST_LEARN_READS	8
+#define CONST_SAMPLE_PERIOD	64
+#define CONST_MAX_REGS		4096
+
+int serialice_const_learning = 1;
+
+/* Only opted in ranges are learned, minus the opted out ranges in them.
+ * Status, FIFO and read-to-clear registers must never be served locally,
+ * so nothing is learned unless the script says where.
+ */
+static SerialICE_ranges const_in[2], const_out[2];
+
+/* Writes to a window of registers may change any of them */
+typedef struct {
+    uint64_t key;
+    uint32_t gen;
+} SerialICE_const_window;
+
+typedef struct {
+    uint64_t key;
+    uint64_t value;
+    uint32_t gen;
+    uint32_t reads;             // identical reads in a row
+    uint32_t served;            // reads served locally since learning
+} SerialICE_const;
+
+static GHashTable *const_regs, *const_windows;
+
+int serialice_add_const_range(int kind, uint32_t base, uint32_t size,
+                              int learn)
+{
+    return add_range(learn ? &const_in[kind] : &const_out[kind], base, size);
+}
+
+static void const_script_reset(void)
+{
+    int kind;
+
+    for (kind = 0; kind < 2; kind++) {
+        const_in[kind].count = 0;
+        const_out[kind].count = 0;
+    }
+    serialice_const_learning = 1;
+}
+
+static uint64_t const_window_key(int kind, uint32_t addr)
+{
+    return ((uint64_t)kind << 32) |
+        (kind == SERIALICE_CONST_IO ? addr & ~7 : addr & TARGET_PAGE_MASK);
+}
+
+static bool const_learns(int kind, uint32_t addr, unsigned int size)
+{
+    if (!serialice_const_learning || find_range(&const_out[kind], addr, size))
+        return false;
+    return find_range(&const_in[kind], addr, size);
+}
+
+static uint64_t target_read(int kind, uint32_t addr, unsigned int size)
+{
+    if (kind == SERIALICE_CONST_IO)
+        return s_target->io_read(addr, size);
+    return s_target->load(addr, size);
+}
+
+static void const_diverged(int kind, uint32_t addr, uint64_t expected,
+                           uint64_t actual)
+{
+    uint64_t eip = current_cpu ? X86_CPU(current_cpu)->env.eip : 0;
+
+    serialice_stats.const_mismatches++;
+    qapi_event_send_serialice_divergence(kind == SERIALICE_CONST_IO ?
+                                         SERIALICE_ACCESS_KIND_IO :
+                                         SERIALICE_ACCESS_KIND_MEMORY,
+                                         addr, eip, expected, actual);
+}
+
+/* Read a target register, serving it locally once it has returned the
+ * same value CONST_LEARN_READS times without a write to its window.
+ * Every CONST_SAMPLE_PERIOD local reads it is checked on the target.
+ */
+static uint64_t const_read(int kind, uint32_t addr, unsigned int size)
+{
+    uint64_t key = ((uint64_t)kind << 40) | ((uint64_t)size << 32) | addr;
+    uint64_t wkey = const_window_key(kind, addr);
+    SerialICE_const_window *w;
+    SerialICE_const *c;
+    uint64_t data;
+
+    if (!const_learns(kind, addr, size))
+        return target_read(kind, addr, size);
+
+    c = g_hash_table_lookup(const_regs, &key);
+    if (!c && g_hash_table_size(const_regs) >= CONST_MAX_REGS)
+        return target_read(kind, addr, size);
+
+    w = g_hash_table_lookup(const_windows, &wkey);
+    if (!w) {
+        w = g_new0(SerialICE_const_window, 1);
+        w->key = wkey;
+        g_hash_table_add(const_windows, w);
+    }
+    if (!c) {
+        c = g_new0(SerialICE_const, 1);
+        c->key = key;
+        c->gen = w->gen;
+        g_hash_table_add(const_regs, c);
+    }
+    if (c->gen != w->gen) {
+        c->gen = w->gen;
+        c->reads = 0;
+    }
+
+    if (c->reads >= CONST_LEARN_READS) {
+        if (++c->served % CONST_SAMPLE_PERIOD) {
+            serialice_stats.const_hits++;
+            return c->value;
+        }
+
+        data = target_read(kind, addr, size);
+        if (data == c->value) {
+            serialice_stats.const_validations++;
+            return data;
+        }
+        const_diverged(kind, addr, c->value, data);
+        c->value = data;
+        c->reads = 1;
+        c->served = 0;
+        return data;
+    }
+
+    data = target_read(kind, addr, size);
+    if (c->reads && data == c->value) {
+        c->reads++;
+    } else {
+        c->value = data;
+        c->reads = 1;
+    }
+    if (c->reads == CONST_LEARN_READS)
+        serialice_stats.const_learned++;
+    return data;
+}
+
+/* A write to the target; forget what was learned in its window */
+static void const_write(int kind, uint32_t addr)
+{
+    uint64_t wkey = const_window_key(kind, addr);
+    SerialICE_const_window *w = g_hash_table_lookup(const_windows, &wkey);
+
+    if (w)
+        w->gen++;
+}
+
+static void const_reset(void)
+{
+    g_hash_table_remove_all(const_regs);
+    g_hash_table_remove_all(const_windows);
+}
+
+// **************************************************************************
+// PCI configuration cycles through 0xcf8/0xcfc and ECAM windows
+
+#define PCI_CONFIG_ADDRESS	0xcf8
+#define PCI_CONFIG_DATA		0xcfc
+
+/* Off unless the script asks: a function can vanish behind the cache's
+ * back, e.g. when a chipset register reached through memory hides it.
+ */
+int serialice_pci_cache = 0;
+
+static SerialICE_ranges ecam_ranges;
+
+/* What is known about the configuration space of a function */
+typedef struct {
+    uint64_t key;               // bus << 8 | devfn
+    bool absent;
+    uint64_t valid;             // header bytes read from the target
+    uint8_t header[PCI_CONFIG_HEADER_SIZE];
+} SerialICE_pci_func;
+
+static GHashTable *pci_funcs;
+
+int serialice_add_ecam_range(uint32_t base, uint32_t size)
+{
+    return add_range(&ecam_ranges, base, size);
+}
+
+static void pci_script_reset(void)
+{
+    ecam_ranges.count = 0;
+    serialice_pci_cache = 0;
+}
+
+/* Send a 0xcf8 write that was held back to be combined with the
+ * following data access.
+ */
+static void pci_flush(void)
+{
+    if (!pci.pending)
+        return;
+
+    pci.pending = false;
+    s_target->io_write(PCI_CONFIG_ADDRESS, 4, pci.address);
+}
+
+/* Header bytes that can't change behind our back */
+static bool pci_read_only(const SerialICE_pci_func *f, unsigned int reg)
+{
+    switch (reg) {
+    case PCI_VENDOR_ID ... PCI_DEVICE_ID + 1:
+    case PCI_REVISION_ID ... PCI_CLASS_DEVICE + 1:
+    case PCI_HEADER_TYPE:
+        return true;
+    case PCI_SUBSYSTEM_VENDOR_ID ... PCI_SUBSYSTEM_ID + 1:
+        return (f->valid & BIT_ULL(PCI_HEADER_TYPE)) &&
+            (f->header[PCI_HEADER_TYPE] & 0x7f) == PCI_HEADER_TYPE_NORMAL;
+    }
+    return false;
+}
+
+static gboolean pci_func_absent(gpointer key, gpointer value, gpointer opaque)
+{
+    return ((SerialICE_pci_func *)value)->absent;
+}
+
+/* @return true if the access was served from what is known */
+static bool pci_cache_read(uint32_t bdf, unsigned int reg, unsigned int size,
+                           uint64_t *data)
+{
+    uint64_t key = bdf;
+    SerialICE_pci_func *f;
+
+    if (!serialice_pci_cache)
+        return false;
+
+    f = g_hash_table_lookup(pci_funcs, &key);
+    if (!f)
+        return false;
+
+    if (f->absent) {
+        *data = MAKE_64BIT_MASK(0, size * 8);
+    } else if (reg + size <= PCI_CONFIG_HEADER_SIZE &&
+               !(~f->valid & MAKE_64BIT_MASK(reg, size))) {
+        *data = ldn_le_p(f->header + reg, size);
+    } else {
+        return false;
+    }
+    serialice_stats.pci_hits++;
+    return true;
+}
+
+static void pci_cache_fill(uint32_t bdf, unsigned int reg, unsigned int size,
+                           uint64_t data)
+{
+    uint64_t key = bdf;
+    SerialICE_pci_func *f;
+    unsigned int i;
+
+    if (!serialice_pci_cache)
+        return;
+
+    f = g_hash_table_lookup(pci_funcs, &key);
+    if (!f) {
+        f = g_new0(SerialICE_pci_func, 1);
+        f->key = key;
+        g_hash_table_add(pci_funcs, f);
+    }
+
+    /* a function without a vendor ID doesn't exist */
+    if (reg == PCI_VENDOR_ID && size >= 2 && (data & 0xffff) == 0xffff) {
+        if (!f->absent)
+            serialice_stats.pci_absent++;
+        f->absent = true;
+        return;
+    }
+
+    for (i = 0; i < size && reg + i < PCI_CONFIG_HEADER_SIZE; i++) {
+        if (pci_read_only(f, reg + i)) {
+            f->header[reg + i] = data >> (i * 8);
+            f->valid |= BIT_ULL(reg + i);
+        }
+    }
+}
+
+static void pci_cache_write(uint32_t bdf, unsigned int reg, unsigned int size)
+{
+    uint64_t key = bdf;
+    SerialICE_pci_func *f = g_hash_table_lookup(pci_funcs, &key);
+    bool bridge = !f || !(f->valid & BIT_ULL(PCI_HEADER_TYPE)) ||
+        (f->header[PCI_HEADER_TYPE] & 0x7f) == PCI_HEADER_TYPE_BRIDGE;
+
+    /* some ID registers are write-once */
+    if (f && reg < PCI_CONFIG_HEADER_SIZE)
+        f->valid &= ~MAKE_64BIT_MASK(reg,
+                                     MIN(size, PCI_CONFIG_HEADER_SIZE - reg));
+
+    /* Device specific registers may hide the function itself */
+    if (reg >= PCI_CONFIG_HEADER_SIZE)
+        g_hash_table_remove(pci_funcs, &key);
+
+    /* Functions may show up when chipset registers or bridge bus numbers
+     * change, so forget which functions were absent.
+     */
+    if (reg >= PCI_CONFIG_HEADER_SIZE ||
+        (bridge && reg <= PCI_SUBORDINATE_BUS &&
+         reg + size > PCI_PRIMARY_BUS))
+        g_hash_table_foreach_remove(pci_funcs, pci_func_absent, NULL);
+}
+
+static void pci_reset(void)
+{
+    pci.address = 0;
+    pci.pending = false;
+    g_hash_table_remove_all(pci_funcs);
+}
+
+static bool pci_config_port(uint16_t port)
+{
+    return port >= PCI_CONFIG_DATA && port < PCI_CONFIG_DATA + 4 &&
+        (pci.address & (1u << 31));
+}
+
+static uint32_t pci_config_bdf(void)
+{
+    return (pci.address >> 8) & 0xffff;
+}
+
+static unsigned int pci_config_reg(uint16_t port)
+{
+    return (pci.address & 0xfc) | (port & 3);
+}
+
+/* Read the 0xcfc data window. A pending 0xcf8 write goes out combined
+ * with the read.
+ */
+static uint64_t pci_config_read(uint16_t port, unsigned int size)
+{
+    uint32_t bdf = pci_config_bdf();
+    unsigned int reg = pci_config_reg(port);
+    uint64_t data;
+
+    if (pci_cache_read(bdf, reg, size, &data))
+        return data;
+
+    if (pci.pending) {
+        pci.pending = false;
+        serialice_stats.pci_combined++;
+        data = s_target->pci_read(pci.address | (port & 3), size);
+    } else {
+        data = s_target->io_read(port, size);
+    }
+    pci_cache_fill(bdf, reg, size, data);
+    return data;
+}
+
+static void pci_config_write(uint16_t port, unsigned int size, uint64_t data)
+{
+    pci_cache_write(pci_config_bdf(), pci_config_reg(port), size);
+
+    if (pci.pending) {
+        pci.pending = false;
+        serialice_stats.pci_combined++;
+        s_target->pci_write(pci.address | (port & 3), size, data);
+    } else {
+        s_target->io_write(port, size, data);
+    }
+}
+
+/* ECAM windows map bus, devfn and register into the address */
+static const SerialICE_range *ecam_range(uint32_t addr, unsigned int size,
+                                         uint32_t *bdf, unsigned int *reg)
+{
+    const SerialICE_range *range = find_range(&ecam_ranges, addr, size);
+
+    if (range) {
+        *bdf = ((addr - range->base) >> 12) & 0xffff;
+        *reg = (addr - range->base) & 0xfff;
+    }
+    return range;
+}
+
+// **************************************************************************
+// debugger reads of target memory
+
+#define DEBUG_LINE_SIZE		256
+#define DEBUG_LINES		16
+#define DEBUG_MAX_AGE_NS	(500 * SCALE_MS)
+
+static SerialICE_ranges debug_ranges;
+
+/* Target memory fetched for the debugger. Lines are only reused while
+ * the VM stays stopped, as the guest may change the target behind them.
+ */
+typedef struct {
+    uint32_t start;
+    unsigned int len;
+    int64_t fetched;
+    uint8_t data[DEBUG_LINE_SIZE];
+} SerialICE_debug_line;
+
+static SerialICE_debug_line debug_lines[DEBUG_LINES];
+
+int serialice_add_debug_range(uint32_t base, uint32_t size)
+{
+    return add_range(&debug_ranges, base, size);
+}
+
+static void debug_script_reset(void)
+{
+    debug_ranges.count = 0;
+}
+
+static void debug_invalidate(uint32_t addr, unsigned int size)
+{
+    int i;
+
+    for (i = 0; i < DEBUG_LINES; i++) {
+        SerialICE_debug_line *l = &debug_lines[i];
+
+        if (addr < l->start + l->len && l->start < addr + size)
+            l->len = 0;
+    }
+}
+
+static void debug_vm_state_change(void *opaque, bool running, RunState state)
+{
+    if (running)
+        memset(debug_lines, 0, sizeof(debug_lines));
+}
+
+/* Fetch target memory bypassing the Lua filter. The commands are
+ * accounted to the debugger instead of the guest.
+ */
+static void debug_fetch(uint32_t addr, uint8_t *buf, unsigned int len)
+{
+    uint64_t commands = serialice_stats.commands;
+    int64_t wire_ns = serialice_stats.wire_ns;
+    unsigned int i, size;
+
+    if (serialice_block_transfers) {
+        s_target->load_block(addr, buf, len);
+    } else {
+        for (i = 0; i < len; i += size) {
+            size = (len - i >= 4) ? 4 : 1;
+            stn_le_p(buf + i, size, s_target->load(addr + i, size));
+        }
+    }
+
+    serialice_stats.debug_commands += serialice_stats.commands - commands;
+    serialice_stats.debug_wire_ns += serialice_stats.wire_ns - wire_ns;
+    serialice_stats.commands = commands;
+    serialice_stats.wire_ns = wire_ns;
+}
+
+static const SerialICE_range *debug_range(uint32_t addr)
+{
+    const SerialICE_range *range = find_range(&debug_ranges, addr, 1);
+
+    return range ? range : find_range(&ra_ranges, addr, 1);
+}
+
+/* Start of the first range in @r above @addr, or @end if there is none
+ * before it
+ */
+static uint64_t next_range(const SerialICE_ranges *r, uint32_t addr,
+                           uint64_t end)
+{
+    int i;
+
+    for (i = 0; i < r->count; i++) {
+        if (r->range[i].base > addr)
+            end = MIN(end, r->range[i].base);
+    }
+    return end;
+}
+
+/* Replace the parts of @buf that lie in target ranges with target memory */
+static void debug_read(uint32_t addr, uint8_t *buf, unsigned int len)
+{
+    int64_t now = get_clock();
+
+    while (len) {
+        const SerialICE_range *range = debug_range(addr);
+        uint32_t line = addr & ~(DEBUG_LINE_SIZE - 1);
+        uint64_t end = (uint64_t)line + DEBUG_LINE_SIZE;
+        SerialICE_debug_line *l;
+        unsigned int n;
+
+        /* stop where a range further in the line starts, debug ranges
+         * take precedence over read-ahead ranges
+         */
+        if (range)
+            end = MIN(end, (uint64_t)range->base + range->size);
+        else
+            end = next_range(&ra_ranges, addr, end);
+        end = next_range(&debug_ranges, addr, end);
+        n = MIN(len, end - addr);
+
+        if (range) {
+            l = &debug_lines[(line / DEBUG_LINE_SIZE) % DEBUG_LINES];
+            if (addr - l->start < l->len && addr + n - l->start <= l->len &&
+                now - l->fetched < DEBUG_MAX_AGE_NS) {
+                serialice_stats.debug_cache_hits++;
+            } else {
+                l->start = MAX(line, range->base);
+                l->len = end - l->start;
+                l->fetched = now;
+                debug_fetch(l->start, l->data, l->len);
+            }
+            memcpy(buf, l->data + addr - l->start, n);
+        }
+
+        addr += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Called by the gdbstub after it accessed QEMU's view of memory. Reads
+ * of target ranges are served from the target while the VM is stopped;
+ * writes only go to QEMU, so drop what we cached for them.
+ */
+void serialice_gdb_access(CPUState *cpu, uint64_t addr, uint8_t *buf,
+                          int len, bool is_write, bool phys)
+{
+    /* replies outside of guest execution can't be recorded */
+    if (!serialice_active || runstate_is_running() ||
+        replay_mode != REPLAY_MODE_NONE)
+        return;
+
+    while (len > 0) {
+        uint64_t page = addr & TARGET_PAGE_MASK;
+        int l = MIN(len, page + TARGET_PAGE_SIZE - addr);
+        hwaddr paddr = addr;
+
+        if (!phys) {
+            paddr = cpu_get_phys_page_debug(cpu, page);
+            if (paddr != -1)
+                paddr += addr & ~TARGET_PAGE_MASK;
+        }
+
+        if (paddr != -1 && paddr + l <= 0x100000000ULL) {
+            if (is_write)
+                debug_invalidate(paddr, l);
+            else
+                debug_read(paddr, buf, l);
+        }
+
+        addr += l;
+        buf += l;
+        len -= l;
+    }
+}
+
+// **************************************************************************
+// target macros
+
+typedef struct {
+    SerialICE_macro_insn code[SERIALICE_MACRO_INSNS];
+    int len;
+    bool writes;                // has stores or port writes
+    bool uploaded;
+} SerialICE_macro;
+
+static SerialICE_macro macros[SERIALICE_MACROS];
+static int num_macros;
+
+static bool macro_insn_valid(const SerialICE_macro_insn *insn, int len)
+{
+    if (insn->rd >= SERIALICE_MACRO_REGS)
+        return false;
+
+    switch (insn->op) {
+    case SERIALICE_MACRO_END:
+        return true;
+    case SERIALICE_MACRO_IN:
+    case SERIALICE_MACRO_OUT:
+    case SERIALICE_MACRO_LOAD:
+    case SERIALICE_MACRO_STORE:
+        if (insn->size != 1 && insn->size != 2 && insn->size != 4)
+            return false;
+        break;
+    case SERIALICE_MACRO_LI ... SERIALICE_MACRO_SHR:
+        break;
+    case SERIALICE_MACRO_BEQ:
+    case SERIALICE_MACRO_BNE:
+    case SERIALICE_MACRO_LOOP:
+        /* a label after the last instruction ends the macro */
+        return insn->rs <= len;
+    default:
+        return false;
+    }
+    return insn->rs < SERIALICE_MACRO_REGS ||
+        insn->rs == SERIALICE_MACRO_NOREG;
+}
+
+/* Macros are only defined on the target when first run */
+static void macro_script_reset(void)
+{
+    num_macros = 0;
+}
+
+/* @return the macro number or -1 if the program is invalid */
+int serialice_define_macro(const SerialICE_macro_insn *code, int len)
+{
+    SerialICE_macro *m;
+    int i;
+
+    if (num_macros == SERIALICE_MACROS || len < 1 ||
+        len > SERIALICE_MACRO_INSNS)
+        return -1;
+
+    m = &macros[num_macros];
+    m->writes = false;
+    for (i = 0; i < len; i++) {
+        if (!macro_insn_valid(&code[i], len))
+            return -1;
+        if (code[i].op == SERIALICE_MACRO_OUT ||
+            code[i].op == SERIALICE_MACRO_STORE)
+            m->writes = true;
+    }
+
+    memcpy(m->code, code, len * sizeof(*code));
+    m->len = len;
+    m->uploaded = false;
+    return num_macros++;
+}
+
+static uint32_t macro_operand(const SerialICE_macro_insn *insn,
+                              const uint32_t *r)
+{
+    if (insn->rs == SERIALICE_MACRO_NOREG)
+        return insn->imm;
+    return insn->imm + r[insn->rs];
+}
+
+/* Run a macro here for shells without the macro extension. It takes one
+ * command per access, but gives the same results.
+ */
+static int macro_interpret(const SerialICE_macro *m, uint32_t *r)
+{
+    int pc = 0, steps;
+
+    for (steps = 0; steps < SERIALICE_MACRO_MAX_STEPS; steps++) {
+        const SerialICE_macro_insn *insn;
+
+        if (pc == m->len)
+            return SERIALICE_MACRO_DONE;
+        insn = &m->code[pc++];
+
+        switch (insn->op) {
+        case SERIALICE_MACRO_END:
+            return SERIALICE_MACRO_DONE;
+        case SERIALICE_MACRO_LI:
+            r[insn->rd] = macro_operand(insn, r);
+            break;
+        case SERIALICE_MACRO_IN:
+            r[insn->rd] = s_target->io_read(macro_operand(insn, r),
+                                            insn->size);
+            break;
+        case SERIALICE_MACRO_OUT:
+            s_target->io_write(macro_operand(insn, r), insn->size,
+                               r[insn->rd]);
+            break;
+        case SERIALICE_MACRO_LOAD:
+            r[insn->rd] = s_target->load(macro_operand(insn, r), insn->size);
+            break;
+        case SERIALICE_MACRO_STORE:
+            s_target->store(macro_operand(insn, r), insn->size, r[insn->rd]);
+            break;
+        case SERIALICE_MACRO_AND:
+            r[insn->rd] &= macro_operand(insn, r);
+            break;
+        case SERIALICE_MACRO_OR:
+            r[insn->rd] |= macro_operand(insn, r);
+            break;
+        case SERIALICE_MACRO_XOR:
+            r[insn->rd] ^= macro_operand(insn, r);
+            break;
+        case SERIALICE_MACRO_ADD:
+            r[insn->rd] += macro_operand(insn, r);
+            break;
+        case SERIALICE_MACRO_SHL:
+            r[insn->rd] <<= macro_operand(insn, r) & 31;
+            break;
+        case SERIALICE_MACRO_SHR:
+            r[insn->rd] >>= macro_operand(insn, r) & 31;
+            break;
+        case SERIALICE_MACRO_BEQ:
+            if (r[insn->rd] == insn->imm)
+                pc = insn->rs;
+            break;
+        case SERIALICE_MACRO_BNE:
+            if (r[insn->rd] != insn->imm)
+                pc = insn->rs;
+            break;
+        case SERIALICE_MACRO_LOOP:
+            if (--r[insn->rd])
+                pc = insn->rs;
+            break;
+        }
+    }
+    return SERIALICE_MACRO_STEP_LIMIT;
+}
+
+/* A macro may have written anywhere on the target */
+static void macro_invalidate(void)
+{
+    ra_invalidate(0, UINT32_MAX);
+    const_reset();
+    g_hash_table_remove_all(pci_funcs);
+
+    /* the target's CONFIG_ADDRESS may not be the guest's anymore */
+    if (pci.address & (1u << 31))
+        pci.pending = true;
+}
+
+static int macro_run_on_target(int id, uint32_t *regs)
+{
+    SerialICE_macro *m = &macros[id];
+    int i, status;
+
+    if (!m->uploaded) {
+        s_target->macro_define(id, m->code, m->len);
+        m->uploaded = true;
+    }
+
+    status = s_target->macro_run(id, regs);
+    if (status == SERIALICE_MACRO_UNKNOWN) {
+        /* the shell restarted and lost all macros */
+        for (i = 0; i < num_macros; i++)
+            macros[i].uploaded = false;
+        s_target->macro_define(id, m->code, m->len);
+        m->uploaded = true;
+        status = s_target->macro_run(id, regs);
+    }
+    return status;
+}
+
+/* Run macro @id with r0-r3 set from @regs, which receives r0-r3 when the
+ * macro ends. Its accesses bypass the Lua filter.
+ *
+ * @return SERIALICE_MACRO_* or -1 if there is no such macro
+ */
+int serialice_run_macro(int id, uint32_t *regs)
+{
+    uint64_t commands = serialice_stats.commands;
+    uint32_t r[SERIALICE_MACRO_REGS] = { 0 };
+    int status;
+
+    if (id < 0 || id >= num_macros)
+        return -1;
+
+    serialice_flush();
+    if (serialice_target_macros) {
+        status = macro_run_on_target(id, regs);
+    } else {
+        memcpy(r, regs, SERIALICE_MACRO_ARGS * sizeof(*regs));
+        status = macro_interpret(&macros[id], r);
+        memcpy(regs, r, SERIALICE_MACRO_ARGS * sizeof(*regs));
+    }
+
+    if (macros[id].writes)
+        macro_invalidate();
+
+    serialice_stats.macro_runs++;
+    serialice_stats.macro_commands += serialice_stats.commands - commands;
+    trace_serialice_macro_run(id, status, serialice_stats.commands - commands);
+    return status;
+}
+
+// **************************************************************************
+// lockstep run against a second target
+
+/* Each access goes to both targets at once, the second one being driven
+ * by its own thread, and reads are compared. Writes are mirrored so both
+ * boards see the same sequence.
+ */
+typedef struct SerialICE_lockstep_op {
+    void (*run) (struct SerialICE_lockstep_op *op);
+    uint32_t addr;
+    uint32_t key;
+    unsigned int size;
+    uint64_t data;
+    const uint8_t *wbuf;
+    uint8_t *rbuf;
+    uint32_t regs[SERIALICE_MACRO_ARGS];
+    cpuid_regs_t cpuid;
+    int status;
+} SerialICE_lockstep_op;
+
+static struct {
+    char *device;
+    int use;                    // SERIALICE_LOCKSTEP_USE_*
+    int stop;                   // stop the VM at the first divergence
+    bool diverged;
+    const SerialICE_target *first;
+    const SerialICE_target *second;
+    SerialICEState *state;      // of the second target
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    SerialICE_lockstep_op *op;  // running on the second target
+    /* macros as defined, to upload again to a target that lost them */
+    SerialICE_macro_insn code[SERIALICE_MACROS][SERIALICE_MACRO_INSNS];
+    int len[SERIALICE_MACROS];
+} lockstep;
+
+static void *lockstep_thread(void *opaque)
+{
+    serialice_serial_bind(lockstep.state);
+
+    qemu_mutex_lock(&lockstep.lock);
+    while (1) {
+        while (!lockstep.op)
+            qemu_cond_wait(&lockstep.cond, &lockstep.lock);
+        qemu_mutex_unlock(&lockstep.lock);
+
+        lockstep.op->run(lockstep.op);
+
+        qemu_mutex_lock(&lockstep.lock);
+        lockstep.op = NULL;
+        qemu_cond_broadcast(&lockstep.cond);
+    }
+    return NULL;
+}
+
+/* Send @op to the second target while the caller talks to the first */
+static void lockstep_start(SerialICE_lockstep_op *op)
+{
+    qemu_mutex_lock(&lockstep.lock);
+    lockstep.op = op;
+    qemu_cond_broadcast(&lockstep.cond);
+    qemu_mutex_unlock(&lockstep.lock);
+}
+
+static void lockstep_wait(void)
+{
+    qemu_mutex_lock(&lockstep.lock);
+    while (lockstep.op)
+        qemu_cond_wait(&lockstep.cond, &lockstep.lock);
+    qemu_mutex_unlock(&lockstep.lock);
+}
+
+/* @return whether the guest gets the value of the second target */
+static bool lockstep_diverged(SerialICEAccessKind kind, uint64_t addr,
+                              uint64_t first, uint64_t second)
+{
+    uint64_t eip = current_cpu ? X86_CPU(current_cpu)->env.eip : 0;
+
+    serialice_stats.lockstep_divergences++;
+    trace_serialice_lockstep_divergence(SerialICEAccessKind_str(kind), addr,
+                                        eip, first, second);
+
+    if (!lockstep.diverged) {
+        lockstep.diverged = true;
+        printf("SerialICE: Targets diverged at eip 0x%08" PRIx64 ": %s 0x%"
+               PRIx64 " read 0x%" PRIx64 " / 0x%" PRIx64 "\n", eip,
+               SerialICEAccessKind_str(kind), addr, first, second);
+        qapi_event_send_serialice_divergence(kind, addr, eip, first, second);
+        if (lockstep.stop && runstate_is_running()) {
+            printf("SerialICE: Stopping VM at the first divergence.\n");
+            vm_stop(RUN_STATE_PAUSED);
+        }
+    }
+    return lockstep.use == SERIALICE_LOCKSTEP_USE_SECOND;
+}
+
+static uint64_t lockstep_compare(SerialICEAccessKind kind, uint64_t addr,
+                                 uint64_t first, uint64_t second)
+{
+    if (first != second && lockstep_diverged(kind, addr, first, second))
+        return second;
+    return first;
+}
+
+static void lockstep_version(void)
+{
+    lockstep.first->version();
+}
+
+static void lockstep_mainboard(void)
+{
+    lockstep.first->mainboard();
+}
+
+static void lockstep_io_read_op(SerialICE_lockstep_op *op)
+{
+    op->data = lockstep.second->io_read(op->addr, op->size);
+}
+
+static uint64_t lockstep_io_read(uint16_t port, unsigned int size)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_io_read_op, .addr = port, .size = size
+    };
+    uint64_t data;
+
+    lockstep_start(&op);
+    data = lockstep.first->io_read(port, size);
+    lockstep_wait();
+    return lockstep_compare(SERIALICE_ACCESS_KIND_IO, port, data, op.data);
+}
+
+static void lockstep_io_write_op(SerialICE_lockstep_op *op)
+{
+    lockstep.second->io_write(op->addr, op->size, op->data);
+}
+
+static void lockstep_io_write(uint16_t port, unsigned int size, uint64_t data)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_io_write_op, .addr = port, .size = size, .data = data
+    };
+
+    lockstep_start(&op);
+    lockstep.first->io_write(port, size, data);
+    lockstep_wait();
+}
+
+static void lockstep_load_op(SerialICE_lockstep_op *op)
+{
+    op->data = lockstep.second->load(op->addr, op->size);
+}
+
+static uint64_t lockstep_load(uint32_t addr, unsigned int size)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_load_op, .addr = addr, .size = size
+    };
+    uint64_t data;
+
+    lockstep_start(&op);
+    data = lockstep.first->load(addr, size);
+    lockstep_wait();
+    return lockstep_compare(SERIALICE_ACCESS_KIND_MEMORY, addr, data,
+                            op.data);
+}
+
+static void lockstep_store_op(SerialICE_lockstep_op *op)
+{
+    lockstep.second->store(op->addr, op->size, op->data);
+}
+
+static void lockstep_store(uint32_t addr, unsigned int size, uint64_t data)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_store_op, .addr = addr, .size = size, .data = data
+    };
+
+    lockstep_start(&op);
+    lockstep.first->store(addr, size, data);
+    lockstep_wait();
+}
+
+static void lockstep_store_block_op(SerialICE_lockstep_op *op)
+{
+    lockstep.second->store_block(op->addr, op->wbuf, op->size);
+}
+
+static void lockstep_store_block(uint32_t addr, const uint8_t *buf,
+                                 unsigned int len)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_store_block_op, .addr = addr, .wbuf = buf, .size = len
+    };
+
+    lockstep_start(&op);
+    lockstep.first->store_block(addr, buf, len);
+    lockstep_wait();
+}
+
+static void lockstep_load_block_op(SerialICE_lockstep_op *op)
+{
+    lockstep.second->load_block(op->addr, op->rbuf, op->size);
+}
+
+static void lockstep_load_block(uint32_t addr, uint8_t *buf, unsigned int len)
+{
+    g_autofree uint8_t *second = g_malloc(len);
+    SerialICE_lockstep_op op = {
+        .run = lockstep_load_block_op, .addr = addr, .rbuf = second,
+        .size = len
+    };
+    unsigned int i;
+
+    lockstep_start(&op);
+    lockstep.first->load_block(addr, buf, len);
+    lockstep_wait();
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] == second[i])
+            continue;
+        if (lockstep_diverged(SERIALICE_ACCESS_KIND_MEMORY, addr + i,
+                              buf[i], second[i]))
+            memcpy(buf, second, len);
+        break;
+    }
+}
+
+static void lockstep_pci_read_op(SerialICE_lockstep_op *op)
+{
+    op->data = lockstep.second->pci_read(op->addr, op->size);
+}
+
+static uint64_t lockstep_pci_read(uint32_t addr, unsigned int size)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_pci_read_op, .addr = addr, .size = size
+    };
+    uint64_t data;
+
+    lockstep_start(&op);
+    data = lockstep.first->pci_read(addr, size);
+    lockstep_wait();
+    return lockstep_compare(SERIALICE_ACCESS_KIND_PCI, addr, data, op.data);
+}
+
+static void lockstep_pci_write_op(SerialICE_lockstep_op *op)
+{
+    lockstep.second->pci_write(op->addr, op->size, op->data);
+}
+
+static void lockstep_pci_write(uint32_t addr, unsigned int size,
+                               uint64_t data)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_pci_write_op, .addr = addr, .size = size, .data = data
+    };
+
+    lockstep_start(&op);
+    lockstep.first->pci_write(addr, size, data);
+    lockstep_wait();
+}
+
+static void lockstep_rdmsr_op(SerialICE_lockstep_op *op)
+{
+    uint32_t hi, lo;
+
+    lockstep.second->rdmsr(op->addr, op->key, &hi, &lo);
+    op->data = (uint64_t)hi << 32 | lo;
+}
+
+static void lockstep_rdmsr(uint32_t addr, uint32_t key, uint32_t *hi,
+                           uint32_t *lo)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_rdmsr_op, .addr = addr, .key = key
+    };
+    uint64_t data;
+
+    lockstep_start(&op);
+    lockstep.first->rdmsr(addr, key, hi, lo);
+    lockstep_wait();
+
+    data = lockstep_compare(SERIALICE_ACCESS_KIND_MSR, addr,
+                            (uint64_t)*hi << 32 | *lo, op.data);
+    *hi = data >> 32;
+    *lo = data;
+}
+
+static void lockstep_wrmsr_op(SerialICE_lockstep_op *op)
+{
+    lockstep.second->wrmsr(op->addr, op->key, op->data >> 32, op->data);
+}
+
+static void lockstep_wrmsr(uint32_t addr, uint32_t key, uint32_t hi,
+                           uint32_t lo)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_wrmsr_op, .addr = addr, .key = key,
+        .data = (uint64_t)hi << 32 | lo
+    };
+
+    lockstep_start(&op);
+    lockstep.first->wrmsr(addr, key, hi, lo);
+    lockstep_wait();
+}
+
+static void lockstep_cpuid_op(SerialICE_lockstep_op *op)
+{
+    lockstep.second->cpuid(op->addr, op->key, &op->cpuid);
+}
+
+static void lockstep_cpuid(uint32_t eax, uint32_t ecx, cpuid_regs_t *ret)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_cpuid_op, .addr = eax, .key = ecx
+    };
+    int i;
+
+    lockstep_start(&op);
+    lockstep.first->cpuid(eax, ecx, ret);
+    lockstep_wait();
+
+    uint32_t first[] = { ret->eax, ret->ebx, ret->ecx, ret->edx };
+    uint32_t second[] = { op.cpuid.eax, op.cpuid.ebx, op.cpuid.ecx,
+                          op.cpuid.edx };
+
+    for (i = 0; i < ARRAY_SIZE(first); i++) {
+        if (first[i] == second[i])
+            continue;
+        if (lockstep_diverged(SERIALICE_ACCESS_KIND_CPUID, eax, first[i],
+                              second[i]))
+            *ret = op.cpuid;
+        break;
+    }
+}
+
+static void lockstep_macro_define_op(SerialICE_lockstep_op *op)
+{
+    lockstep.second->macro_define(op->addr, lockstep.code[op->addr],
+                                  lockstep.len[op->addr]);
+}
+
+static void lockstep_macro_define(int id, const SerialICE_macro_insn *code,
+                                  int len)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_macro_define_op, .addr = id
+    };
+
+    memcpy(lockstep.code[id], code, len * sizeof(*code));
+    lockstep.len[id] = len;
+
+    lockstep_start(&op);
+    lockstep.first->macro_define(id, code, len);
+    lockstep_wait();
+}
+
+/* Only one of the shells may have restarted, so each target gets the
+ * macro again on its own and the caller sees an unknown macro only if
+ * it was never defined.
+ */
+static int lockstep_macro_run_on(const SerialICE_target *target, int id,
+                                 uint32_t *regs)
+{
+    uint32_t args[SERIALICE_MACRO_ARGS];
+    int status;
+
+    memcpy(args, regs, sizeof(args));
+    status = target->macro_run(id, regs);
+    if (status == SERIALICE_MACRO_UNKNOWN && lockstep.len[id]) {
+        target->macro_define(id, lockstep.code[id], lockstep.len[id]);
+        memcpy(regs, args, sizeof(args));
+        status = target->macro_run(id, regs);
+    }
+    return status;
+}
+
+static void lockstep_macro_run_op(SerialICE_lockstep_op *op)
+{
+    op->status = lockstep_macro_run_on(lockstep.second, op->addr, op->regs);
+}
+
+static int lockstep_macro_run(int id, uint32_t *regs)
+{
+    SerialICE_lockstep_op op = {
+        .run = lockstep_macro_run_op, .addr = id
+    };
+    int i, status;
+
+    memcpy(op.regs, regs, sizeof(op.regs));
+    lockstep_start(&op);
+    status = lockstep_macro_run_on(lockstep.first, id, regs);
+    lockstep_wait();
+
+    if (status != op.status) {
+        if (lockstep_diverged(SERIALICE_ACCESS_KIND_MACRO, id, status,
+                              op.status)) {
+            memcpy(regs, op.regs, sizeof(op.regs));
+            return op.status;
+        }
+        return status;
+    }
+    for (i = 0; i < SERIALICE_MACRO_ARGS; i++) {
+        if (regs[i] == op.regs[i])
+            continue;
+        if (lockstep_diverged(SERIALICE_ACCESS_KIND_MACRO, id, regs[i],
+                              op.regs[i]))
+            memcpy(regs, op.regs, sizeof(op.regs));
+        break;
+    }
+    return status;
+}
+
+static const SerialICE_target lockstep_target = {
+    .version = lockstep_version,
+    .mainboard = lockstep_mainboard,
+    .io_read = lockstep_io_read,
+    .io_write = lockstep_io_write,
+    .load = lockstep_load,
+    .store = lockstep_store,
+    .store_block = lockstep_store_block,
+    .load_block = lockstep_load_block,
+    .pci_read = lockstep_pci_read,
+    .pci_write = lockstep_pci_write,
+    .rdmsr = lockstep_rdmsr,
+    .wrmsr = lockstep_wrmsr,
+    .cpuid = lockstep_cpuid,
+    .macro_define = lockstep_macro_define,
+    .macro_run = lockstep_macro_run,
+};
+
+/* Run a second target on @device in lockstep with the first one. Set up
+ * by the script while it is loaded, the target is attached afterwards.
+ *
+ * @use: SERIALICE_LOCKSTEP_USE_* for which value the guest sees when the
+ *       targets differ
+ * @stop: whether to stop the VM at the first divergence
+ */
+int serialice_set_lockstep(const char *device, int use, int stop)
+{
+    if (serialice_active || lockstep.device)
+        return -1;
+
+    lockstep.device = g_strdup(device);
+    lockstep.use = use;
+    lockstep.stop = stop;
+    return 0;
+}
+
+static void lockstep_script_reset(void)
+{
+    g_free(lockstep.device);
+    lockstep.device = NULL;
+}
+
+static void lockstep_attach(void)
+{
+    if (!lockstep.device)
+        return;
+
+    /* the replay log only holds the replies of one target */
+    if (replay_mode != REPLAY_MODE_NONE) {
+        warn_report("SerialICE: Lockstep with %s disabled under record "
+                    "and replay", lockstep.device);
+        return;
+    }
+
+    printf("SerialICE: Lockstep with %s\n", lockstep.device);
+    lockstep.second = serialice_serial_open(lockstep.device, &lockstep.state);
+    lockstep.first = s_target;
+
+    qemu_mutex_init(&lockstep.lock);
+    qemu_cond_init(&lockstep.cond);
+    qemu_thread_create(&lockstep.thread, "serialice-lockstep",
+                       lockstep_thread, NULL, QEMU_THREAD_DETACHED);
+
+    s_target = &lockstep_target;
+}
+
+// **************************************************************************
+// log of target writes since reset, saved with snapshots
+
+#define LOGGED_IO		1
+#define LOGGED_STORE		2
+#define LOGGED_MSR		3
+
+typedef struct QEMU_PACKED {
+    uint8_t kind;
+    uint8_t size;
+    uint32_t addr;
+    uint32_t key;
+    uint64_t data;
+} SerialICE_logged_write;
+
+int serialice_record_writes = 0;
+
+static GByteArray *write_log;
+
+static void write_log_script_reset(void)
+{
+    serialice_record_writes = 0;
+}
+
+typedef struct {
+    uint8_t *data;
+    uint32_t len;
+} SerialICE_write_log;
+
+static SerialICE_write_log write_log_state;
+
+static void write_log_add(int kind, uint32_t addr, uint32_t key,
+                          unsigned int size, uint64_t data)
+{
+    SerialICE_logged_write w = {
+        .kind = kind,
+        .size = size,
+        .addr = addr,
+        .key = key,
+        .data = data,
+    };
+
+    if (serialice_record_writes)
+        g_byte_array_append(write_log, (uint8_t *)&w, sizeof(w));
+}
+
+/* Bring a freshly reset target to the state the log was recorded in.
+ * Contiguous stores go out through write combining as block writes.
+ */
+static void write_log_replay(const uint8_t *log, uint32_t len)
+{
+    SerialICE_logged_write w;
+    uint32_t i;
+
+    printf("SerialICE: Replaying %u target writes...\n",
+           (unsigned int)(len / sizeof(w)));
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, log + i, sizeof(w));
+        switch (w.kind) {
+        case LOGGED_STORE:
+            wc_store(w.addr, w.size, w.data);
+            break;
+        case LOGGED_IO:
+            serialice_flush();
+            s_target->io_write(w.addr, w.size, w.data);
+            break;
+        case LOGGED_MSR:
+            serialice_flush();
+            s_target->wrmsr(w.addr, w.key, w.data >> 32, w.data);
+            break;
+        }
+    }
+    serialice_flush();
+}
+
+static void write_log_reset(void *opaque)
+{
+    g_byte_array_set_size(write_log, 0);
+    const_reset();
+    pci_reset();
+}
+
+static int write_log_pre_save(void *opaque)
+{
+    serialice_flush();
+    /* the log may grow or be loaded over while the copy is in use */
+    write_log_state.data = g_memdup2(write_log->data, write_log->len);
+    write_log_state.len = write_log->len;
+    return 0;
+}
+
+static int write_log_post_save(void *opaque)
+{
+    g_free(write_log_state.data);
+    write_log_state.data = NULL;
+    return 0;
+}
+
+static int write_log_post_load(void *opaque, int version_id)
+{
+    /* when replaying, there is no target to bring into shape */
+    if (replay_mode != REPLAY_MODE_PLAY)
+        write_log_replay(write_log_state.data, write_log_state.len);
+
+    g_byte_array_set_size(write_log, 0);
+    g_byte_array_append(write_log, write_log_state.data, write_log_state.len);
+    const_reset();
+    pci_reset();
+    g_free(write_log_state.data);
+    write_log_state.data = NULL;
+    return 0;
+}
+
+static const VMStateDescription vmstate_serialice = {
+    .name = "serialice",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = write_log_pre_save,
+    .post_save = write_log_post_save,
+    .post_load = write_log_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(len, SerialICE_write_log),
+        VMSTATE_VBUFFER_ALLOC_UINT32(data, SerialICE_write_log, 0, NULL,
+                                     len),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void milestone_bh(void *opaque)
+{
+    char *name = opaque;
+    Error *err = NULL;
+
+    if (save_snapshot(name, true, NULL, false, NULL, &err)) {
+        printf("SerialICE: Saved milestone '%s' (%u bytes of target writes)\n",
+               name, write_log->len);
+    } else {
+        error_report_err(err);
+    }
+    g_free(name);
+}
+
+/* Save a snapshot named @name from the main loop. Loading it with loadvm
+ * replays the target writes recorded up to here to the target.
+ */
+void serialice_milestone(const char *name)
+{
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), milestone_bh,
+                            g_strdup(name));
+}
+
+// **************************************************************************
+// TCG plugin notification
+
+/* Without a subscribed plugin this is a single bit test, so callers
+ * only pay for building the transaction when somebody listens.
+ */
+static inline bool plugin_wants_transactions(void)
+{
+    return current_cpu &&
+        test_bit(QEMU_PLUGIN_EV_VCPU_SERIALICE, current_cpu->plugin_mask);
+}
+
+static void plugin_transaction(enum qemu_plugin_serialice_kind kind,
+                               uint64_t addr, unsigned int size,
+                               uint64_t value, int mux, int64_t wire_start)
+{
+    struct qemu_plugin_serialice_transaction tx = {
+        .kind = kind,
+        .addr = addr,
+        .size = size,
+        .value = value,
+        .route = mux & (READ_FROM_QEMU | READ_FROM_SERIALICE),
+        .wire_ns = serialice_stats.wire_ns - wire_start,
+    };
+
+    qemu_plugin_vcpu_serialice_cb(current_cpu, &tx);
+}
+
+// **************************************************************************
+// wire time profile per firmware function
+
+/* Transactions are only timed while the profile is on */
+static inline int64_t profile_start(void)
+{
+    return serialice_function_profile ? get_clock() : 0;
+}
+
+static void profile_transaction(int64_t start, int64_t wire_start)
+{
+    uint64_t pc = 0;
+
+    if (current_cpu) {
+        CPUX86State *env = &X86_CPU(current_cpu)->env;
+
+        pc = env->segs[R_CS].base + env->eip;
+    }
+    serialice_profile_transaction(pc, serialice_stats.wire_ns - wire_start,
+                                  get_clock() - start);
+}
+
+// **************************************************************************
+// heatmap of target accesses by page and port over time
+
+#define HEAT_IO			0
+#define HEAT_MEM		1
+#define HEAT_MIN_SLOTS		1024
+
+int serialice_heatmap = 0;
+static int64_t heat_bucket_ns = NANOSECONDS_PER_SECOND;
+
+/* Accesses to a port or 4K page during one time bucket */
+typedef struct {
+    uint64_t key;               // bucket << 32 | kind << 31 | port or page
+    uint32_t reads;
+    uint32_t writes;
+    int64_t wire_ns;
+} SerialICE_heat;
+
+/* Open addressing with linear probing, slots without accesses are free */
+static struct {
+    SerialICE_heat *slots;
+    size_t size;                // power of two
+    size_t used;
+    int64_t start;
+} heat;
+
+static inline bool heat_used(const SerialICE_heat *h)
+{
+    return h->reads || h->writes;
+}
+
+static SerialICE_heat *heat_slot(SerialICE_heat *slots, size_t size,
+                                 uint64_t key)
+{
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+    for (i &= size - 1; heat_used(&slots[i]); i = (i + 1) & (size - 1)) {
+        if (slots[i].key == key)
+            break;
+    }
+    return &slots[i];
+}
+
+static void heat_grow(void)
+{
+    size_t size = MAX(heat.size * 2, HEAT_MIN_SLOTS);
+    SerialICE_heat *slots = g_new0(SerialICE_heat, size);
+    size_t i;
+
+    for (i = 0; i < heat.size; i++) {
+        if (heat_used(&heat.slots[i]))
+            *heat_slot(slots, size, heat.slots[i].key) = heat.slots[i];
+    }
+    g_free(heat.slots);
+    heat.slots = slots;
+    heat.size = size;
+}
+
+static void heat_reset(void)
+{
+    g_free(heat.slots);
+    heat.slots = NULL;
+    heat.size = heat.used = 0;
+    heat.start = get_clock();
+}
+
+/* Start or stop the heatmap. Buckets are @bucket_ms wide, changing
+ * their width starts over.
+ */
+void serialice_set_heatmap(int enable, int64_t bucket_ms)
+{
+    if (bucket_ms > 0 && bucket_ms * SCALE_MS != heat_bucket_ns) {
+        heat_bucket_ns = bucket_ms * SCALE_MS;
+        heat_reset();
+    }
+    if (enable && !heat.start)
+        heat.start = get_clock();
+    serialice_heatmap = enable;
+}
+
+static void heat_script_reset(void)
+{
+    serialice_heatmap = 0;
+    heat_bucket_ns = NANOSECONDS_PER_SECOND;
+    heat_reset();
+    heat.start = 0;
+}
+
+static void heat_access(int kind, uint32_t addr, bool write, int64_t wire_ns)
+{
+    uint64_t bucket = (get_clock() - heat.start) / heat_bucket_ns;
+    uint32_t unit = kind == HEAT_MEM ? addr >> TARGET_PAGE_BITS : addr;
+    uint64_t key = bucket << 32 | (uint64_t)kind << 31 | unit;
+    SerialICE_heat *h;
+
+    if ((heat.used + 1) * 4 > heat.size * 3)
+        heat_grow();
+
+    h = heat_slot(heat.slots, heat.size, key);
+    if (!heat_used(h)) {
+        h->key = key;
+        heat.used++;
+    }
+    if (write) {
+        h->writes++;
+    } else {
+        h->reads++;
+    }
+    h->wire_ns += wire_ns;
+}
+
 // **************************************************************************
 // high level communication with the SerialICE shell
 
@@ -72,9 +1885,14 @@ uint64_t serialice_rdmsr(CPUX86State *env, uint32_t addr, uint32_t key)
 {
     uint32_t hi = 0, lo = 0;
     uint64_t data;
+    int64_t wire_start = serialice_stats.wire_ns;
+    int64_t start = profile_start();
 
     int mux = s_filter->rdmsr_pre(addr);
 
+    trace_serialice_route("rdmsr", addr, 8, mux);
+
+    serialice_flush();
     if (mux & READ_FROM_SERIALICE)
         s_target->rdmsr(addr, key, &hi, &lo);
 
@@ -88,6 +1906,12 @@ uint64_t serialice_rdmsr(CPUX86State *env, uint32_t addr, uint32_t key)
     data = hi;
     data <<= 32;
     data |= lo;
+
+    if (plugin_wants_transactions())
+        plugin_transaction(QEMU_PLUGIN_SERIALICE_MSR_READ, addr, 8, data, mux,
+                           wire_start);
+    if (start)
+        profile_transaction(start, wire_start);
     return data;
 }
 
@@ -95,31 +1919,55 @@ void serialice_wrmsr(CPUX86State *env, uint64_t data, uint32_t addr, uint32_t ke
 {
     uint32_t hi = (data >> 32);
     uint32_t lo = (data & 0xffffffff);
+    int64_t wire_start = serialice_stats.wire_ns;
+    int64_t start = profile_start();
 
     int mux = s_filter->wrmsr_pre(addr, &hi, &lo);
 
-    if (mux & WRITE_TO_SERIALICE)
+    trace_serialice_route("wrmsr", addr, 8, mux);
+
+    serialice_flush();
+    if (mux & WRITE_TO_SERIALICE) {
         s_target->wrmsr(addr, key, hi, lo);
+        write_log_add(LOGGED_MSR, addr, key, 8, ((uint64_t)hi << 32) | lo);
+    }
     if (mux & WRITE_TO_QEMU) {
         data = lo | ((uint64_t)hi)<<32;
         cpu_wrmsr(env, addr, data);
     }
     s_filter->wrmsr_post();
+
+    if (plugin_wants_transactions())
+        plugin_transaction(QEMU_PLUGIN_SERIALICE_MSR_WRITE, addr, 8,
+                           ((uint64_t)hi << 32) | lo, mux, wire_start);
+    if (start)
+        profile_transaction(start, wire_start);
 }
 
 cpuid_regs_t serialice_cpuid(CPUX86State *env, uint32_t eax, uint32_t ecx)
 {
     cpuid_regs_t ret;
+    int64_t wire_start = serialice_stats.wire_ns;
+    int64_t start = profile_start();
     ret.eax = ret.ebx = ret.ecx = ret.edx = 0;
 
     int mux = s_filter->cpuid_pre(eax, ecx);
 
+    trace_serialice_route("cpuid", eax, 4, mux);
+
+    serialice_flush();
     if (mux & READ_FROM_SERIALICE)
         s_target->cpuid(eax, ecx, &ret);
     if (mux & READ_FROM_QEMU)
         ret = cpu_cpuid(env, eax, ecx);
 
     s_filter->cpuid_post(&ret);
+
+    if (plugin_wants_transactions())
+        plugin_transaction(QEMU_PLUGIN_SERIALICE_CPUID, eax, 4, ret.eax, mux,
+                           wire_start);
+    if (start)
+        profile_transaction(start, wire_start);
     return ret;
 }
 
@@ -133,14 +1981,43 @@ cpuid_regs_t serialice_cpuid(CPUX86State *env, uint32_t eax, uint32_t ecx)
  */
 int serialice_handle_load(uint32_t addr, uint64_t * data, unsigned int size)
 {
+    int64_t wire_start = serialice_stats.wire_ns;
+    int64_t start = profile_start();
     int mux = s_filter->load_pre(addr, size);
 
-    if (mux & READ_FROM_SERIALICE)
-        *data = s_target->load(addr, size);
+    trace_serialice_route("load", addr, size, mux);
+
+    if (mux & READ_FROM_SERIALICE) {
+        const SerialICE_range *range = find_range(&ra_ranges, addr, size);
+        uint32_t bdf;
+        unsigned int reg;
+
+        serialice_flush();
+        if (ecam_range(addr, size, &bdf, &reg)) {
+            if (!pci_cache_read(bdf, reg, size, data)) {
+                *data = s_target->load(addr, size);
+                pci_cache_fill(bdf, reg, size, *data);
+            }
+        } else if (range && serialice_block_transfers) {
+            *data = ra_load(range, addr, size);
+        } else {
+            *data = const_read(SERIALICE_CONST_MEM, addr, size);
+        }
+    }
 
     if (!(mux & READ_FROM_QEMU))
         s_filter->load_post(data);
 
+    /* Loads QEMU handles are only seen here if they were also forwarded */
+    if ((mux & READ_FROM_SERIALICE) && plugin_wants_transactions())
+        plugin_transaction(QEMU_PLUGIN_SERIALICE_MEM_READ, addr, size, *data,
+                           mux, wire_start);
+    if (start)
+        profile_transaction(start, wire_start);
+    if (serialice_heatmap && (mux & READ_FROM_SERIALICE))
+        heat_access(HEAT_MEM, addr, false,
+                    serialice_stats.wire_ns - wire_start);
+
     return !(mux & READ_FROM_QEMU);
 }
 
@@ -155,61 +2032,787 @@ int serialice_handle_load(uint32_t addr, uint64_t * data, unsigned int size)
 
 int serialice_handle_store(uint32_t addr, uint64_t data, unsigned int size)
 {
+    int64_t wire_start = serialice_stats.wire_ns;
+    int64_t start = profile_start();
+    uint32_t bdf;
+    unsigned int reg;
     int mux = s_filter->store_pre(addr, size, &data);
 
-    if (mux & WRITE_TO_SERIALICE)
-        s_target->store(addr, size, data);
+    trace_serialice_route("store", addr, size, mux);
+
+    if (mux & WRITE_TO_SERIALICE) {
+        write_log_add(LOGGED_STORE, addr, 0, size, data);
+        ra_invalidate(addr, size);
+        const_write(SERIALICE_CONST_MEM, addr);
+        if (ecam_range(addr, size, &bdf, &reg))
+            pci_cache_write(bdf, reg, size);
+        if (find_range(&wc_ranges, addr, size)) {
+            wc_store(addr, size, data);
+        } else {
+            serialice_flush();
+            s_target->store(addr, size, data);
+        }
+    }
 
     s_filter->store_post();
+
+    if (plugin_wants_transactions())
+        plugin_transaction(QEMU_PLUGIN_SERIALICE_MEM_WRITE, addr, size, data,
+                           mux, wire_start);
+    if (start)
+        profile_transaction(start, wire_start);
+    if (serialice_heatmap && (mux & WRITE_TO_SERIALICE))
+        heat_access(HEAT_MEM, addr, true, serialice_stats.wire_ns - wire_start);
     return !(mux & WRITE_TO_QEMU);
 }
 
 #define mask_data(val,bytes) (val & (((uint64_t)1<<(bytes*8))-1))
 
+void serialice_set_io_route(uint16_t first, uint16_t last, int route)
+{
+    unsigned int port;
+
+    for (port = first; port <= last; port++) {
+        int shift = (port & 3) * 2;
+
+        serialice_io_routes[port >> 2] &= ~(3 << shift);
+        serialice_io_routes[port >> 2] |= (route & 3) << shift;
+    }
+}
+
+static void io_route_script_reset(void)
+{
+    memset(serialice_io_routes, ROUTE_FILTER, sizeof(serialice_io_routes));
+}
+
 uint64_t serialice_io_read(uint16_t port, unsigned int size)
 {
     uint64_t data = 0;
-    int mux = s_filter->io_read_pre(port, size);
+    int route = serialice_io_route(port);
+    int mux = route;
+    int64_t wire_start = serialice_stats.wire_ns;
+    int64_t start = profile_start();
+
+    if (route == ROUTE_FILTER)
+        mux = s_filter->io_read_pre(port, size);
+    trace_serialice_route("in", port, size, mux);
 
     if (mux & READ_FROM_QEMU)
         data = cpu_io_read_wrapper(port, size);
-    if (mux & READ_FROM_SERIALICE)
-        data = s_target->io_read(port, size);
+    if (mux & READ_FROM_SERIALICE) {
+        if (pci_config_port(port)) {
+            /* combined stores are newer than a held back 0xcf8 write */
+            if (wc.len)
+                serialice_flush();
+            data = pci_config_read(port, size);
+        } else {
+            serialice_flush();
+            data = const_read(SERIALICE_CONST_IO, port, size);
+        }
+    }
 
     data = mask_data(data, size);
-    s_filter->io_read_post(&data);
+    if (route == ROUTE_FILTER)
+        s_filter->io_read_post(&data);
+
+    if (plugin_wants_transactions())
+        plugin_transaction(QEMU_PLUGIN_SERIALICE_IO_READ, port, size, data, mux,
+                           wire_start);
+    if (start)
+        profile_transaction(start, wire_start);
+    if (serialice_heatmap && (mux & READ_FROM_SERIALICE))
+        heat_access(HEAT_IO, port, false, serialice_stats.wire_ns - wire_start);
     return data;
 }
 
 void serialice_io_write(uint16_t port, unsigned int size, uint64_t data)
 {
+    int route = serialice_io_route(port);
+    int mux = route;
+    int64_t wire_start = serialice_stats.wire_ns;
+    int64_t start = profile_start();
+
     data = mask_data(data, size);
-    int mux = s_filter->io_write_pre(&data, port, size);
-    data = mask_data(data, size);
+    if (route == ROUTE_FILTER) {
+        mux = s_filter->io_write_pre(&data, port, size);
+        data = mask_data(data, size);
+    }
+    trace_serialice_route("out", port, size, mux);
 
     if (mux & WRITE_TO_QEMU)
         cpu_io_write_wrapper(port, size, data);
-    if (mux & WRITE_TO_SERIALICE)
-        s_target->io_write(port, size, data);
+    if (mux & WRITE_TO_SERIALICE) {
+        if (port == PCI_CONFIG_ADDRESS && size == 4) {
+            /* a held back address is superseded, don't send it */
+            pci.pending = false;
+            serialice_flush();
+            pci.address = data;
+            pci.pending = true;
+        } else if (pci_config_port(port)) {
+            if (wc.len)
+                serialice_flush();
+            pci_config_write(port, size, data);
+        } else {
+            serialice_flush();
+            s_target->io_write(port, size, data);
+        }
+        write_log_add(LOGGED_IO, port, 0, size, data);
+        const_write(SERIALICE_CONST_IO, port);
+    }
+
+    if (route == ROUTE_FILTER)
+        s_filter->io_write_post();
+
+    if (plugin_wants_transactions())
+        plugin_transaction(QEMU_PLUGIN_SERIALICE_IO_WRITE, port, size, data, mux,
+                           wire_start);
+    if (start)
+        profile_transaction(start, wire_start);
+    if (serialice_heatmap && (mux & WRITE_TO_SERIALICE))
+        heat_access(HEAT_IO, port, true, serialice_stats.wire_ns - wire_start);
+}
+
+// **************************************************************************
+// monitor interface
+
+SerialICEInfo *qmp_query_serialice(Error **errp)
+{
+    SerialICEInfo *info = g_new0(SerialICEInfo, 1);
+
+    info->active = serialice_active;
+    info->version = g_strdup(serialice_version);
+    info->mainboard = g_strdup(serialice_mainboard);
+    info->virtual_time = serialice_virtual_time;
+    info->commands = serialice_stats.commands;
+    info->wire_ns = serialice_stats.wire_ns;
+    info->lua_errors = serialice_stats.lua_errors;
+    info->wc_stores = serialice_stats.wc_stores;
+    info->wc_flushes = serialice_stats.wc_flushes;
+    info->ra_hits = serialice_stats.ra_hits;
+    info->ra_fetches = serialice_stats.ra_fetches;
+    info->recorded_writes = write_log ? write_log->len : 0;
+    info->debug_commands = serialice_stats.debug_commands;
+    info->debug_wire_ns = serialice_stats.debug_wire_ns;
+    info->debug_cache_hits = serialice_stats.debug_cache_hits;
+    info->const_learned = serialice_stats.const_learned;
+    info->const_hits = serialice_stats.const_hits;
+    info->const_validations = serialice_stats.const_validations;
+    info->const_mismatches = serialice_stats.const_mismatches;
+    info->pci_combined = serialice_stats.pci_combined;
+    info->pci_hits = serialice_stats.pci_hits;
+    info->pci_absent = serialice_stats.pci_absent;
+    info->macro_runs = serialice_stats.macro_runs;
+    info->macro_commands = serialice_stats.macro_commands;
+    info->compressed_bytes = serialice_stats.compressed_bytes;
+    info->compressed_chars = serialice_stats.compressed_chars;
+    if (lockstep.second)
+        info->lockstep_device = g_strdup(lockstep.device);
+    info->lockstep_divergences = serialice_stats.lockstep_divergences;
+    info->frame_timeouts = serialice_stats.frame_timeouts;
+    info->frame_corrupt = serialice_stats.frame_corrupt;
+    info->frame_retransmits = serialice_stats.frame_retransmits;
+
+    return info;
+}
+
+/* The transport belongs to the vCPU thread, so requests coming from the
+ * monitor are run there between translation blocks.
+ */
+static void flush_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    serialice_flush();
+}
+
+void qmp_serialice_flush(Error **errp)
+{
+    if (!serialice_active) {
+        error_setg(errp, "SerialICE is not active");
+        return;
+    }
+    if (replay_mode != REPLAY_MODE_NONE) {
+        error_setg(errp, "Target commands from the monitor can't be "
+                   "replayed");
+        return;
+    }
+
+    run_on_cpu(first_cpu, flush_on_cpu, RUN_ON_CPU_NULL);
+}
+
+void qmp_serialice_set_route(uint16_t first, uint16_t last,
+                             SerialICERoute route, Error **errp)
+{
+    static const int routes[SERIALICE_ROUTE__MAX] = {
+        [SERIALICE_ROUTE_LUA] = ROUTE_FILTER,
+        [SERIALICE_ROUTE_QEMU] = ROUTE_QEMU,
+        [SERIALICE_ROUTE_TARGET] = ROUTE_TARGET,
+        [SERIALICE_ROUTE_BOTH] = ROUTE_BOTH,
+    };
+
+    if (first > last) {
+        error_setg(errp, "Port range 0x%x-0x%x is empty", first, last);
+        return;
+    }
+
+    serialice_set_io_route(first, last, routes[route]);
+}
+
+void hmp_info_serialice(Monitor *mon, const QDict *qdict)
+{
+    g_autoptr(SerialICEInfo) info = qmp_query_serialice(NULL);
+
+    if (!info->active) {
+        monitor_printf(mon, "SerialICE is not active.\n");
+        return;
+    }
+
+    monitor_printf(mon, "Commands: %" PRIu64 ", %" PRId64 " ms on the wire\n",
+                   info->commands, info->wire_ns / SCALE_MS);
+    monitor_printf(mon, "Guest time: %s\n", info->virtual_time ?
+                   "stopped while waiting for the target" : "real time");
+    monitor_printf(mon, "Lua errors: %" PRIu64 "\n", info->lua_errors);
+    monitor_printf(mon, "Combined stores: %" PRIu64 " in %" PRIu64
+                   " block writes\n", info->wc_stores, info->wc_flushes);
+    monitor_printf(mon, "Read-ahead: %" PRIu64 " hits, %" PRIu64
+                   " block reads\n", info->ra_hits, info->ra_fetches);
+    monitor_printf(mon, "Recorded target writes: %" PRIu64 " bytes%s\n",
+                   info->recorded_writes,
+                   serialice_record_writes ? "" : " (off)");
+    monitor_printf(mon, "Debugger: %" PRIu64 " commands, %" PRId64
+                   " ms on the wire, %" PRIu64 " cache hits\n",
+                   info->debug_commands, info->debug_wire_ns / SCALE_MS,
+                   info->debug_cache_hits);
+    monitor_printf(mon, "Constant registers: %" PRIu64 " learned, %" PRIu64
+                   " local reads, %" PRIu64 " checks, %" PRIu64
+                   " mismatches%s\n", info->const_learned, info->const_hits,
+                   info->const_validations, info->const_mismatches,
+                   serialice_const_learning ? "" : " (off)");
+    monitor_printf(mon, "PCI config: %" PRIu64 " combined cycles, %" PRIu64
+                   " cached reads, %" PRIu64 " absent functions%s\n",
+                   info->pci_combined, info->pci_hits, info->pci_absent,
+                   serialice_pci_cache ? "" : " (cache off)");
+    monitor_printf(mon, "Macros: %" PRIu64 " runs in %" PRIu64
+                   " commands%s\n", info->macro_runs, info->macro_commands,
+                   serialice_target_macros ? "" : " (run on the host)");
+    monitor_printf(mon, "Compressed block reads: %" PRIu64 " bytes in %"
+                   PRIu64 " characters%s\n", info->compressed_bytes,
+                   info->compressed_chars,
+                   serialice_compressed_transfers ? "" : " (off)");
+    monitor_printf(mon, "Framed commands: %" PRIu64 " lost and %" PRIu64
+                   " corrupt replies, %" PRIu64 " retransmits%s\n",
+                   info->frame_timeouts, info->frame_corrupt,
+                   info->frame_retransmits,
+                   serialice_framed_transfers ? "" : " (off)");
+    if (info->lockstep_device)
+        monitor_printf(mon, "Lockstep with %s: %" PRIu64 " divergences, "
+                       "guest sees the %s target\n", info->lockstep_device,
+                       info->lockstep_divergences,
+                       lockstep.use == SERIALICE_LOCKSTEP_USE_SECOND ?
+                       "second" : "first");
+}
+
+static int compare_heat_keys(const void *a, const void *b)
+{
+    const SerialICE_heat *ha = a, *hb = b;
+
+    return ha->key < hb->key ? -1 : ha->key > hb->key;
+}
+
+/* @return the used slots sorted by bucket, kind and port or page */
+static SerialICE_heat *heat_sorted(size_t *n)
+{
+    SerialICE_heat *h = g_new(SerialICE_heat, heat.used + 1);
+    size_t i;
+
+    for (i = 0, *n = 0; i < heat.size; i++) {
+        if (heat_used(&heat.slots[i]))
+            h[(*n)++] = heat.slots[i];
+    }
+    qsort(h, *n, sizeof(*h), compare_heat_keys);
+    return h;
+}
+
+static uint32_t heat_address(uint64_t key)
+{
+    uint32_t unit = key & 0x7fffffff;
+
+    return (key & (1ull << 31)) ? unit << TARGET_PAGE_BITS : unit;
+}
+
+/* The table belongs to the vCPU thread, which adds to and grows it, so
+ * the monitor works on copies made there.
+ */
+typedef struct {
+    SerialICE_heat *h;
+    size_t n;
+} SerialICE_heat_copy;
+
+static void heat_copy_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    SerialICE_heat_copy *c = data.host_ptr;
+
+    c->h = heat_sorted(&c->n);
+}
+
+static SerialICE_heat *heat_copy(size_t *n)
+{
+    SerialICE_heat_copy c;
+
+    run_on_cpu(first_cpu, heat_copy_on_cpu, RUN_ON_CPU_HOST_PTR(&c));
+    *n = c.n;
+    return c.h;
+}
+
+static void heat_reset_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    heat_reset();
+}
+
+static void heat_enable_on_cpu(CPUState *cpu, run_on_cpu_data data)
+{
+    serialice_set_heatmap(data.host_int, 0);
+}
+
+/* One line per port or page and bucket, for plotting */
+static int heat_save(const char *path)
+{
+    g_autofree SerialICE_heat *h = NULL;
+    FILE *f = fopen(path, "w");
+    size_t i, n;
+
+    if (!f)
+        return -1;
+
+    h = heat_copy(&n);
+    fprintf(f, "# time_ms,kind,address,reads,writes,wire_us\n");
+    for (i = 0; i < n; i++) {
+        fprintf(f, "%" PRId64 ",%s,0x%08x,%u,%u,%" PRId64 "\n",
+                (int64_t)(h[i].key >> 32) * heat_bucket_ns / SCALE_MS,
+                (h[i].key & (1ull << 31)) ? "memory" : "io",
+                heat_address(h[i].key), h[i].reads, h[i].writes,
+                h[i].wire_ns / SCALE_US);
+    }
+    return fclose(f);
+}
+
+void hmp_serialice_heatmap(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_str(qdict, "op");
+    const char *file = qdict_get_try_str(qdict, "file");
+
+    if (!serialice_active) {
+        monitor_printf(mon, "SerialICE is not active.\n");
+        return;
+    }
+
+    if (strcmp(op, "on") == 0) {
+        run_on_cpu(first_cpu, heat_enable_on_cpu, RUN_ON_CPU_HOST_INT(1));
+    } else if (strcmp(op, "off") == 0) {
+        run_on_cpu(first_cpu, heat_enable_on_cpu, RUN_ON_CPU_HOST_INT(0));
+    } else if (strcmp(op, "reset") == 0) {
+        run_on_cpu(first_cpu, heat_reset_on_cpu, RUN_ON_CPU_NULL);
+    } else if (strcmp(op, "save") == 0) {
+        if (!file) {
+            monitor_printf(mon, "Missing file name\n");
+        } else if (heat_save(file)) {
+            monitor_printf(mon, "Could not write %s: %s\n", file,
+                           strerror(errno));
+        }
+    } else {
+        monitor_printf(mon, "Unexpected argument '%s'\n", op);
+    }
+}
+
+/* Accesses to a port or page over all buckets */
+typedef struct {
+    uint32_t unit;              // kind << 31 | port or page
+    uint64_t first, last;       // buckets
+    uint64_t reads, writes;
+    int64_t wire_ns;
+} SerialICE_heat_total;
+
+static int compare_heat_units(const void *a, const void *b)
+{
+    uint32_t ua = ((const SerialICE_heat *)a)->key;
+    uint32_t ub = ((const SerialICE_heat *)b)->key;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+static int compare_heat_wire(const void *a, const void *b)
+{
+    int64_t wa = ((const SerialICE_heat_total *)a)->wire_ns;
+    int64_t wb = ((const SerialICE_heat_total *)b)->wire_ns;
+
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+/* The ports and pages with the most wire time and when they were used */
+void hmp_info_serialice_heatmap(Monitor *mon, const QDict *qdict)
+{
+    g_autofree SerialICE_heat *h = NULL;
+    g_autofree SerialICE_heat_total *t = NULL;
+    size_t i, n, units = 0;
+
+    if (!serialice_active) {
+        monitor_printf(mon, "SerialICE is not active.\n");
+        return;
+    }
+
+    h = heat_copy(&n);
+    monitor_printf(mon, "Heatmap is %s, %zu entries in %" PRId64
+                   " ms buckets\n", serialice_heatmap ? "on" : "off",
+                   n, heat_bucket_ns / SCALE_MS);
+
+    qsort(h, n, sizeof(*h), compare_heat_units);
+    t = g_new0(SerialICE_heat_total, n + 1);
+    for (i = 0; i < n; i++) {
+        uint64_t bucket = h[i].key >> 32;
+        SerialICE_heat_total *u = &t[units ? units - 1 : 0];
+
+        if (!units || u->unit != (uint32_t)h[i].key) {
+            u = &t[units++];
+            u->unit = h[i].key;
+            u->first = bucket;
+        }
+        u->last = MAX(u->last, bucket);
+        u->first = MIN(u->first, bucket);
+        u->reads += h[i].reads;
+        u->writes += h[i].writes;
+        u->wire_ns += h[i].wire_ns;
+    }
+    qsort(t, units, sizeof(*t), compare_heat_wire);
+
+    monitor_printf(mon, "%-6s %-10s %10s %10s %10s  %s\n", "kind",
+                   "address", "reads", "writes", "wire (ms)", "active (s)");
+    for (i = 0; i < units && i < 20; i++) {
+        monitor_printf(mon, "%-6s 0x%08x %10" PRIu64 " %10" PRIu64
+                       " %10.3f  %.1f-%.1f\n",
+                       (t[i].unit & (1u << 31)) ? "memory" : "io",
+                       heat_address(t[i].unit), t[i].reads, t[i].writes,
+                       t[i].wire_ns / 1e6,
+                       (double)t[i].first * heat_bucket_ns /
+                       NANOSECONDS_PER_SECOND,
+                       (double)(t[i].last + 1) * heat_bucket_ns /
+                       NANOSECONDS_PER_SECOND);
+    }
+}
+
+// **************************************************************************
+// local RAM registered by the script
+
+/* Guest RAM backed by @backend at @offset, or by anonymous memory */
+typedef struct {
+    uint64_t base, size;
+    HostMemoryBackend *backend;
+    uint64_t offset;
+} SerialICE_ram;
+
+static GArray *pending_ram;     // registered while the script loads
+static GPtrArray *ram_backends; // backends mapped by SerialICE
+static bool ram_committed;
+
+static void ram_map(const SerialICE_ram *r)
+{
+    g_autofree char *name = g_strdup_printf("serialice-ram@%" PRIx64,
+                                            r->base);
+    MemoryRegion *mr = g_new(MemoryRegion, 1);
+
+    printf("SerialICE: Local RAM at 0x%08" PRIx64 " (0x%08" PRIx64
+           " bytes)%s%s\n", r->base, r->size, r->backend ? " from " : "",
+           r->backend ?
+           object_get_canonical_path_component(OBJECT(r->backend)) : "");
+
+    if (r->backend) {
+        memory_region_init_alias(mr, NULL, name,
+                                 host_memory_backend_get_memory(r->backend),
+                                 r->offset, r->size);
+    } else {
+        memory_region_init_ram(mr, NULL, name, r->size, &error_fatal);
+    }
+    memory_region_add_subregion(get_system_memory(), r->base, mr);
+}
+
+/* Back [@base, @base + @size) with local RAM, taken from the memory
+ * backend @memdev at @offset if given. Ranges are collected while the
+ * script loads so that ranges which touch can be merged. Hooks run
+ * without the BQL and the migration stream is fixed by then, so later
+ * ranges are refused.
+ */
+int serialice_register_ram(uint64_t base, uint64_t size, const char *memdev,
+                           uint64_t offset, Error **errp)
+{
+    SerialICE_ram r = { .base = base, .size = size, .offset = offset };
+    MemoryRegion *mr;
+
+    if (ram_committed) {
+        error_setg(errp, "Local RAM can only be registered while the "
+                   "script loads");
+        return -1;
+    }
+
+    if (!size || base + size < base) {
+        error_setg(errp, "Invalid RAM range 0x%" PRIx64 "+0x%" PRIx64,
+                   base, size);
+        return -1;
+    }
+
+    if (memdev) {
+        r.backend = (HostMemoryBackend *)
+            object_resolve_path_type(memdev, TYPE_MEMORY_BACKEND, NULL);
+        if (!r.backend) {
+            error_setg(errp, "Memory backend '%s' not found", memdev);
+            return -1;
+        }
+
+        mr = host_memory_backend_get_memory(r.backend);
+        if (offset > memory_region_size(mr) ||
+            size > memory_region_size(mr) - offset) {
+            error_setg(errp, "Memory backend '%s' is too small", memdev);
+            return -1;
+        }
+
+        /* several ranges may share one backend */
+        if (!ram_backends)
+            ram_backends = g_ptr_array_new();
+        if (!g_ptr_array_find(ram_backends, r.backend, NULL)) {
+            if (host_memory_backend_is_mapped(r.backend)) {
+                error_setg(errp, "Memory backend '%s' is already in use",
+                           memdev);
+                return -1;
+            }
+            host_memory_backend_set_mapped(r.backend, true);
+            vmstate_register_ram_global(mr);
+            g_ptr_array_add(ram_backends, r.backend);
+        }
+    }
+
+    if (!pending_ram)
+        pending_ram = g_array_new(FALSE, FALSE, sizeof(SerialICE_ram));
+    g_array_append_val(pending_ram, r);
+    return 0;
+}
+
+static int compare_ram(gconstpointer a, gconstpointer b)
+{
+    const SerialICE_ram *ra = a, *rb = b;
+
+    return ra->base < rb->base ? -1 : ra->base > rb->base;
+}
+
+/* @b starts at or after @a and continues it in the same kind of memory */
+static bool ram_mergeable(const SerialICE_ram *a, const SerialICE_ram *b)
+{
+    if (b->base > a->base + a->size || a->backend != b->backend)
+        return false;
+
+    return !a->backend || b->base - a->base == b->offset - a->offset;
+}
+
+/* Map the ranges registered while the script loaded, one RAM block for
+ * each run of ranges that touch or overlap.
+ */
+static void ram_commit(void)
+{
+    SerialICE_ram *r, *last = NULL;
+    guint i, n = 0;
+
+    ram_committed = true;
+    if (!pending_ram)
+        return;
+
+    g_array_sort(pending_ram, compare_ram);
+    r = &g_array_index(pending_ram, SerialICE_ram, 0);
+    for (i = 0; i < pending_ram->len; i++) {
+        if (last && ram_mergeable(last, &r[i])) {
+            last->size = MAX(last->base + last->size,
+                             r[i].base + r[i].size) - last->base;
+            continue;
+        }
+        if (last && r[i].base < last->base + last->size) {
+            error_report("SerialICE: Local RAM at 0x%" PRIx64 " overlaps "
+                         "0x%" PRIx64 " with different backing", r[i].base,
+                         last->base);
+            exit(1);
+        }
+        r[n] = r[i];
+        last = &r[n++];
+    }
+
+    for (i = 0; i < n; i++)
+        ram_map(&r[i]);
+
+    g_array_free(pending_ram, TRUE);
+    pending_ram = NULL;
+}
+
+/* Ranges are only mapped once committed, so only backends need undoing */
+static void ram_script_reset(void)
+{
+    HostMemoryBackend *backend;
+    guint i;
 
-    s_filter->io_write_post();
+    assert(!ram_committed);
+    for (i = 0; ram_backends && i < ram_backends->len; i++) {
+        backend = g_ptr_array_index(ram_backends, i);
+        vmstate_unregister_ram(host_memory_backend_get_memory(backend), NULL);
+        host_memory_backend_set_mapped(backend, false);
+    }
+    if (ram_backends) {
+        g_ptr_array_free(ram_backends, TRUE);
+        ram_backends = NULL;
+    }
+    if (pending_ram) {
+        g_array_free(pending_ram, TRUE);
+        pending_ram = NULL;
+    }
 }
 
 // **************************************************************************
 // initialization and exit
 
+/* Version and mainboard of the target last attached through this device,
+ * kept so the script can be loaded while the target is still being
+ * attached.
+ */
+static char *session_cache_path(void)
+{
+    g_autofree char *dev = NULL;
+
+    if (serialice_device == NULL)
+        return NULL;
+
+    dev = g_path_get_basename(serialice_device);
+    return g_build_filename(g_get_user_cache_dir(), "serialice", dev, NULL);
+}
+
+static int session_load(char **version, char **mainboard)
+{
+    g_autofree char *path = session_cache_path();
+    g_autofree char *contents = NULL;
+    char **lines;
+
+    if (!path || !g_file_get_contents(path, &contents, NULL, NULL))
+        return 0;
+
+    lines = g_strsplit(contents, "\n", 3);
+    if (g_strv_length(lines) < 2) {
+        g_strfreev(lines);
+        return 0;
+    }
+    *version = g_strdup(lines[0]);
+    *mainboard = g_strdup(lines[1]);
+    g_strfreev(lines);
+    return 1;
+}
+
+static void session_save(void)
+{
+    g_autofree char *path = session_cache_path();
+    g_autofree char *dir = NULL;
+    g_autofree char *contents = NULL;
+
+    if (!path)
+        return;
+
+    dir = g_path_get_dirname(path);
+    contents = g_strdup_printf("%s\n%s\n", serialice_version,
+                               serialice_mainboard);
+    if (g_mkdir_with_parents(dir, 0700) ||
+        !g_file_set_contents(path, contents, -1, NULL))
+        warn_report("SerialICE: Could not save session to %s", path);
+}
+
+/* Undo what a script run for another mainboard has set up. The script's
+ * settings are only used once SerialICE is active.
+ */
+static void script_reset(void)
+{
+    assert(!serialice_active);
+
+    wc_script_reset();
+    ra_script_reset();
+    const_script_reset();
+    pci_script_reset();
+    debug_script_reset();
+    macro_script_reset();
+    lockstep_script_reset();
+    write_log_script_reset();
+    heat_script_reset();
+    io_route_script_reset();
+    ram_script_reset();
+    serialice_serial_script_reset();
+    serialice_profile_script_reset();
+}
+
+static void *serialice_attach(void *opaque)
+{
+    s_target = serialice_serial_init();
+    s_target->version();
+    s_target->mainboard();
+    return NULL;
+}
+
 static void serialice_init(void)
 {
+    g_autofree char *version = NULL;
+    g_autofree char *mainboard = NULL;
+    QemuThread attach;
+
     dumb_screen();
 
     printf("SerialICE: Open connection to target hardware...\n");
     printf("SerialICE: ROM size....: 0x%08x\n", serialice_rom_size);
-    s_target = serialice_serial_init();
-    s_target->version();
-    s_target->mainboard();
 
-    printf("SerialICE: LUA init...\n");
-    s_filter = serialice_lua_init(SERIALICE_LUA_SCRIPT);
+    /* the attach thread can't write to the replay log */
+    if (replay_mode == REPLAY_MODE_NONE &&
+        session_load(&version, &mainboard)) {
+        /* Fast attach: run the script for the cached mainboard while
+         * talking to the target.
+         */
+        printf("SerialICE: Cached session: %s on %s\n", version, mainboard);
+        qemu_thread_create(&attach, "serialice-attach", serialice_attach,
+                           NULL, QEMU_THREAD_JOINABLE);
+
+        printf("SerialICE: LUA init...\n");
+        s_filter = serialice_lua_init(SERIALICE_LUA_SCRIPT, mainboard);
+
+        qemu_thread_join(&attach);
+        if (strcmp(version, serialice_version) ||
+            strcmp(mainboard, serialice_mainboard)) {
+            session_save();
+            printf("SerialICE: Target differs from the cached session, "
+                   "reloading the script for %s\n", serialice_mainboard);
+            serialice_lua_exit();
+            script_reset();
+            s_filter = serialice_lua_init(SERIALICE_LUA_SCRIPT,
+                                          serialice_mainboard);
+        }
+    } else {
+        serialice_attach(NULL);
+        session_save();
+
+        printf("SerialICE: LUA init...\n");
+        s_filter = serialice_lua_init(SERIALICE_LUA_SCRIPT,
+                                      serialice_mainboard);
+    }
+
+    ram_commit();
+    lockstep_attach();
+
+    qemu_add_vm_change_state_handler(wc_vm_state_change, NULL);
+    if (replay_mode == REPLAY_MODE_NONE)
+        wc_timer = timer_new_ns(QEMU_CLOCK_REALTIME, wc_timer_expired, NULL);
+    qemu_add_vm_change_state_handler(debug_vm_state_change, NULL);
+
+    write_log = g_byte_array_new();
+    const_regs = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                       NULL, g_free);
+    const_windows = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                          NULL, g_free);
+    pci_funcs = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                      NULL, g_free);
+    qemu_register_reset(write_log_reset, NULL);
+    vmstate_register(NULL, 0, &vmstate_serialice, &write_log_state);
 
     /* Let the rest of Qemu know we're alive */
     serialice_active = 1;
@@ -238,13 +2841,6 @@ static void pc_init_serialice(MachineState *machine)
     MemoryRegion *rom_memory = get_system_memory();
     uint64_t pci_hole64_size = 0;
 
-    if (machine->ram_size != (DEFAULT_RAM_SIZE * 1024 * 1024)) {
-        printf
-            ("Warning: Running SerialICE with non-default ram size is not supported.\n");
-        exit(1);
-    }
-
-
     if (!pcms->max_ram_below_4g) {
         pcms->max_ram_below_4g = 0xe0000000; /* default: 3.5G */
     }
@@ -337,6 +2933,7 @@ static void serialice_machine_options(MachineClass *mc)
 {
     mc->alias = "serialice";
     mc->desc = "SerialICE Debugger";
+    mc->default_ram_size = DEFAULT_RAM_SIZE * MiB;
     mc->init = pc_init_serialice;
     mc->max_cpus = 255;
 }
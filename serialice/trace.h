@@ -0,0 +1 @@
+#include "trace/trace-serialice.h"
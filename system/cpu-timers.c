@@ -135,6 +135,37 @@ void cpu_disable_ticks(void)
                          &timers_state.vm_clock_lock);
 }
 
+/*
+ * Stop the VM clock and ticks while a vCPU waits for something outside the
+ * VM, such as a SerialICE target.  Unlike cpu_disable_ticks() these do not
+ * need the BQL, and ticks are only restarted if the VM is still running.
+ */
+void cpu_pause_ticks(void)
+{
+    seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                       &timers_state.vm_clock_lock);
+    if (timers_state.cpu_ticks_enabled) {
+        timers_state.cpu_ticks_offset += cpu_get_host_ticks();
+        timers_state.cpu_clock_offset = cpu_get_clock_locked();
+        timers_state.cpu_ticks_enabled = 0;
+    }
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                         &timers_state.vm_clock_lock);
+}
+
+void cpu_resume_ticks(void)
+{
+    seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                       &timers_state.vm_clock_lock);
+    if (!timers_state.cpu_ticks_enabled && runstate_is_running()) {
+        timers_state.cpu_ticks_offset -= cpu_get_host_ticks();
+        timers_state.cpu_clock_offset -= get_clock();
+        timers_state.cpu_ticks_enabled = 1;
+    }
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                         &timers_state.vm_clock_lock);
+}
+
 static bool icount_state_needed(void *opaque)
 {
     return icount_enabled();
@@ -30,7 +30,7 @@
 void helper_outb(CPUX86State *env, uint32_t port, uint32_t data)
 {
 #ifdef CONFIG_SERIALICE
-    if (serialice_active) {
+    if (serialice_active && serialice_io_route(port) != ROUTE_QEMU) {
 	serialice_io_write(port, 1, data);
 	return;
     }
@@ -43,7 +43,7 @@ void helper_outb(CPUX86State *env, uint32_t port, uint32_t data)
 target_ulong helper_inb(CPUX86State *env, uint32_t port)
 {
 #ifdef CONFIG_SERIALICE
-    if (serialice_active) {
+    if (serialice_active && serialice_io_route(port) != ROUTE_QEMU) {
         return (target_ulong) serialice_io_read(port, 1);
     }
 #endif
@@ -55,7 +55,7 @@ target_ulong helper_inb(CPUX86State *env, uint32_t port)
 void helper_outw(CPUX86State *env, uint32_t port, uint32_t data)
 {
 #ifdef CONFIG_SERIALICE
-    if (serialice_active) {
+    if (serialice_active && serialice_io_route(port) != ROUTE_QEMU) {
         serialice_io_write(port, 2, data);
         return;
     }
@@ -68,7 +68,7 @@ void helper_outw(CPUX86State *env, uint32_t port, uint32_t data)
 target_ulong helper_inw(CPUX86State *env, uint32_t port)
 {
 #ifdef CONFIG_SERIALICE
-    if (serialice_active) {
+    if (serialice_active && serialice_io_route(port) != ROUTE_QEMU) {
         return (target_ulong) serialice_io_read(port, 2);
     }
 #endif
@@ -80,7 +80,7 @@ target_ulong helper_inw(CPUX86State *env, uint32_t port)
 void helper_outl(CPUX86State *env, uint32_t port, uint32_t data)
 {
 #ifdef CONFIG_SERIALICE
-    if (serialice_active) {
+    if (serialice_active && serialice_io_route(port) != ROUTE_QEMU) {
         serialice_io_write(port, 4, data);
         return;
     }
@@ -93,7 +93,7 @@ void helper_outl(CPUX86State *env, uint32_t port, uint32_t data)
 target_ulong helper_inl(CPUX86State *env, uint32_t port)
 {
 #ifdef CONFIG_SERIALICE
-    if (serialice_active) {
+    if (serialice_active && serialice_io_route(port) != ROUTE_QEMU) {
         return (target_ulong) serialice_io_read(port, 4);
     }
 #endif